@@ -0,0 +1,328 @@
+// Throughput of the hit validation, of the EventAssembler, of the waveform unpacking, of the columnar events,
+// of the misalignment scans and of the .raw file readers on synthetic payloads
+// Each payload is copied to a reused buffer before being decoded, as the reader does, so it is in cache.
+
+#include "synthetic.hpp"
+
+#include <sampasrs/decoder.hpp>
+#include <sampasrs/raw_file.hpp>
+#include <sampasrs/simd.hpp>
+
+#include <boost/core/bit.hpp>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace sampasrs;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int repetitions = 20;
+
+// Best time of many repetitions, in ns per hit
+template <typename Function>
+double time_per_hit(size_t n_hits, Function&& function)
+{
+  double best = std::numeric_limits<double>::max();
+  for (int i = 0; i < repetitions; ++i) {
+    const auto start = Clock::now();
+    function();
+    best = std::min(best, std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+  }
+  return best / static_cast<double>(n_hits);
+}
+
+void validation(const std::vector<Payload>& payloads, size_t n_hits)
+{
+  volatile size_t sink = 0;
+
+  const auto per_hit = time_per_hit(n_hits, [&] {
+    size_t valid = 0;
+    for (const auto& payload : payloads) {
+      for (size_t i = 0; i < payload.n_hits(); ++i) {
+        auto hit = payload.hit(i);
+        valid += hit.pk() == Hit::HEADER ? hit.check_header_integrity() : hit.compute_data_parity();
+      }
+    }
+    sink = valid;
+  });
+
+  const auto& matrix = Hit::parity_matrix();
+  const auto per_word = time_per_hit(n_hits, [&] {
+    size_t valid = 0;
+    for (const auto& payload : payloads) {
+      for (size_t i = 0; i < payload.n_hits(); ++i) {
+        valid += matrix(payload.hit(i).data);
+      }
+    }
+    sink = valid;
+  });
+
+  std::vector<uint8_t> parity(1024);
+  const auto batch = time_per_hit(n_hits, [&] {
+    size_t valid = 0;
+    for (const auto& payload : payloads) {
+      matrix.compute(payload.data.data() + payload.hit_offset, payload.n_hits(), parity.data());
+      valid += parity[0];
+    }
+    sink = valid;
+  });
+
+  fmt::print("Validation  | per hit {:6.2f} ns/hit | parity matrix {:6.2f} ns/hit | batch {:6.2f} ns/hit ({})\n",
+      per_hit, per_word, batch, ParityMatrix::vectorized ? "AVX2" : "scalar");
+}
+
+template <typename Assembler>
+double decode_time(Assembler& sorter, const std::vector<Payload>& payloads, size_t n_hits)
+{
+  Payload buffer {};
+  buffer.data.reserve(9000);
+  const auto decode = [&] {
+    for (const auto& payload : payloads) {
+      buffer.data.assign(payload.data.begin(), payload.data.end());
+      sorter.process(buffer);
+    }
+  };
+  decode(); // warm up the event memory
+  return time_per_hit(n_hits, decode);
+}
+
+// The type erased EventAssembler against one with the handler inlined
+void assembler(const std::string& name, const std::vector<Payload>& payloads, size_t n_hits)
+{
+  volatile size_t sink = 0;
+  const auto handler = [&](Event&& event) { sink = sink + event.hits.size(); };
+
+  EventAssembler erased(handler);
+  erased.process_invalid_events = true;
+  auto inlined = make_event_assembler(handler);
+  inlined.process_invalid_events = true;
+
+  // Alternated, so that a slow phase of the machine affects both
+  double erased_time = std::numeric_limits<double>::max();
+  double inlined_time = std::numeric_limits<double>::max();
+  for (int round = 0; round < 5; ++round) {
+    erased_time = std::min(erased_time, decode_time(erased, payloads, n_hits));
+    inlined_time = std::min(inlined_time, decode_time(inlined, payloads, n_hits));
+  }
+  fmt::print("Assembler   | {:<16} std::function {:6.2f} ns/hit | inlined {:6.2f} ns/hit | {:4.2f}x\n",
+      name, erased_time, inlined_time, erased_time / inlined_time);
+}
+
+// Decoding the waveform words of complete events, one word at a time, all at once and into a ColumnarEvent
+void unpacking(const std::string& name, const std::vector<Payload>& payloads)
+{
+  std::vector<Event> events {};
+  EventAssembler sorter([&](Event&& event) { events.push_back(std::move(event)); });
+  sorter.process_invalid_events = true;
+  for (auto payload : payloads) {
+    sorter.process(payload);
+  }
+
+  size_t n_words = 0;
+  size_t max_words = 0;
+  for (const auto& event : events) {
+    n_words += event.total_word_count();
+    max_words = std::max(max_words, event.total_word_count());
+  }
+  std::vector<short> samples(max_words);
+  volatile short sink = 0;
+
+  const auto per_word = time_per_hit(n_words, [&] {
+    for (const auto& event : events) {
+      size_t word = 0;
+      for (size_t waveform = 0; waveform < event.waveform_count(); ++waveform) {
+        for (size_t i = 0; i < event.word_count(waveform); ++i) {
+          samples[word++] = event.get_word(waveform, i);
+        }
+      }
+      sink = samples[0];
+    }
+  });
+
+  const auto bulk = time_per_hit(n_words, [&] {
+    for (const auto& event : events) {
+      event.unpack(samples.data());
+      sink = samples[0];
+    }
+  });
+
+  // The columnar events decode the same words, plus the columns of the waveforms
+  ColumnarEvent columns {};
+  const auto columnar = time_per_hit(n_words, [&] {
+    for (const auto& event : events) {
+      columns.assign(event);
+      sink = columns.samples[0];
+    }
+  });
+
+  fmt::print("Unpacking   | {:<16} get_word {:6.2f} ns/word | unpack {:6.2f} ns/word | {:4.1f}x | ColumnarEvent {:6.2f} ns/word\n",
+      name, per_word, bulk, per_word / bulk, columnar);
+}
+
+// Decoding and a typical analysis loop, the highest sample of each channel, on Events and on ColumnarEvents
+void columnar(const std::string& name, const std::vector<Payload>& payloads, size_t n_hits)
+{
+  std::vector<short> maximum(512);
+  volatile short sink = 0;
+
+  auto from_hits = make_event_assembler([&](Event&& event) {
+    for (size_t waveform = 0; waveform < event.waveform_count(); ++waveform) {
+      auto& maximum_value = maximum[event.get_header(waveform).global_channel()];
+      auto value = maximum_value;
+      for (size_t i = 0; i < event.word_count(waveform); ++i) {
+        value = std::max(value, event.get_word(waveform, i));
+      }
+      maximum_value = value;
+    }
+    sink = maximum[0];
+  });
+  from_hits.process_invalid_events = true;
+
+  auto from_columns = make_event_assembler([&](const ColumnarEvent& event) {
+    for (size_t waveform = 0; waveform < event.waveform_count(); ++waveform) {
+      // Accumulated in a local, maximum could alias the samples
+      const auto* samples = event.waveform(waveform);
+      auto& maximum_value = maximum[event.channel[waveform]];
+      auto value = maximum_value;
+      for (size_t i = 0; i < event.sample_count[waveform]; ++i) {
+        value = std::max(value, samples[i]);
+      }
+      maximum_value = value;
+    }
+    sink = maximum[0];
+  });
+  from_columns.process_invalid_events = true;
+
+  const auto hits_time = decode_time(from_hits, payloads, n_hits);
+  const auto columns_time = decode_time(from_columns, payloads, n_hits);
+  fmt::print("Columnar    | {:<16} Event {:6.2f} ns/hit | ColumnarEvent {:6.2f} ns/hit | {:4.1f}x\n",
+      name, hits_time, columns_time, hits_time / columns_time);
+}
+
+// The caca removal scans of misaligned payloads: the scalar search, checking one candidate alignment at a time,
+// against the vectorized scans checking all the alignments at once
+void alignment(const std::string& name, const std::vector<Payload>& payloads)
+{
+  // As the assembler did before
+  const auto check_alignment = [](const uint8_t* begin, const uint8_t* end) {
+    const auto n_hits = (end - begin) / static_cast<long>(sizeof(Hit));
+    for (long i = 0; i < n_hits; ++i, begin += sizeof(Hit)) {
+      if ((*begin & 0b00000010U) != 0 || (*(begin + 4) & 0b01000000U) != 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  size_t n_bytes = 0;
+  for (const auto& payload : payloads) {
+    n_bytes += payload.data.size();
+  }
+  volatile size_t sink = 0;
+
+  const auto scalar = time_per_hit(n_bytes, [&] {
+    unsigned int previous = 0;
+    for (const auto& payload : payloads) {
+      const auto& data = payload.data;
+      const auto header = std::find_if(data.begin(), data.end(), [](auto x) { return x != 0xcaU; }) - data.begin();
+      const auto* hits = data.data() + header + Payload::header_size;
+      const auto* end = data.data() + data.size();
+      unsigned int found = previous;
+      if (!check_alignment(hits + previous, end)) {
+        for (found = 0; found < sizeof(Hit) && !check_alignment(hits + found, end); ++found) {
+        }
+      }
+      previous = found % sizeof(Hit);
+      sink = sink + found;
+    }
+  });
+
+  const auto vectorized = time_per_hit(n_bytes, [&] {
+    unsigned int previous = 0;
+    for (const auto& payload : payloads) {
+      const auto& data = payload.data;
+      const auto header = find_first_not(data.data(), data.size(), 0xca);
+      const auto offset = header + Payload::header_size;
+      const auto alignments = valid_alignments(data.data() + offset, data.size() - offset);
+      unsigned int found = previous;
+      if ((alignments & (1U << previous)) == 0) {
+        found = alignments == 0 ? sizeof(Hit) : boost::core::countr_zero(alignments);
+      }
+      previous = found % sizeof(Hit);
+      sink = sink + found;
+    }
+  });
+
+  fmt::print("Alignment   | {:<16} scalar {:6.3f} ns/byte | vectorized {:6.3f} ns/byte | {:4.1f}x\n",
+      name, scalar, vectorized, scalar / vectorized);
+}
+
+// Reading a .raw file with a stream, a new vector per payload, against walking the mapped file in place
+// The file was just written, so it is in the page cache and only the reader overhead is measured
+void reading(const std::string& name, const std::vector<Payload>& payloads)
+{
+  const auto file_name = (std::filesystem::temp_directory_path() / "sampa_decoder_benchmark.raw").string();
+  {
+    std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+    for (const auto& payload : payloads) {
+      payload.write(file);
+    }
+  }
+  const auto n_bytes = static_cast<size_t>(std::filesystem::file_size(file_name));
+  volatile size_t sink = 0;
+
+  const auto stream = time_per_hit(n_bytes, [&] {
+    std::ifstream file(file_name, std::ios::binary);
+    while (!file.eof()) {
+      const auto payload = Payload::read(file);
+      sink = sink + payload.data.size();
+    }
+  });
+
+  const auto mapped = time_per_hit(n_bytes, [&] {
+    const raw_file::MappedFile file(file_name);
+    auto input = file.input();
+    while (!input.eof()) {
+      const auto payload = PayloadView::read(input);
+      sink = sink + payload.data.size();
+    }
+  });
+
+  std::filesystem::remove(file_name);
+  fmt::print("Reading     | {:<16} stream {:7.1f} MB/s | mapped {:7.1f} MB/s | {:4.1f}x\n",
+      name, 1e3 / stream, 1e3 / mapped, stream / mapped);
+}
+
+int main(int argc, const char* argv[])
+{
+  size_t events = 1000;
+  if (argc > 1) {
+    events = std::stoul(argv[1]);
+  }
+
+  static constexpr size_t channels = 128;
+  for (size_t words : {40, 3}) {
+    const auto payloads = synthetic::make_payloads(synthetic::make_hits(events, channels, words));
+    size_t n_hits = 0;
+    for (const auto& payload : payloads) {
+      n_hits += payload.n_hits();
+    }
+
+    fmt::print("{} events, {} channels, {} to {} words per waveform\n", events, channels, words, words + 6);
+    validation(payloads, n_hits);
+    const auto* name = words > 10 ? "long waveforms" : "short waveforms";
+    assembler(name, payloads, n_hits);
+    unpacking(name, payloads);
+    columnar(name, payloads, n_hits);
+    // Few events, so the payloads stay in cache as in the reader buffer
+    alignment(name, synthetic::make_misaligned_payloads(synthetic::make_hits(10, channels, words)));
+    reading(name, payloads);
+  }
+}
@@ -0,0 +1,73 @@
+// Throughput of the buffers used between the acquisition pipeline stages
+// One producer thread pushes payloads as fast as possible and one consumer thread drains them.
+
+#include <sampasrs/decoder.hpp>
+#include <sampasrs/fifo.hpp>
+
+#include <fmt/core.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace sampasrs;
+using Clock = std::chrono::steady_clock;
+
+template <typename Buffer>
+void run(const std::string& name, size_t n_payloads, size_t batch_size)
+{
+  Buffer buffer(100000, 50, 10000); // same configuration of the reader buffer
+  std::atomic_bool done = false;
+  size_t received = 0;
+
+  std::thread consumer([&] {
+    while (!done || !buffer.empty()) {
+      auto& payloads = buffer.get();
+      received += payloads.size();
+    }
+  });
+
+  const auto start = Clock::now();
+  std::vector<Payload> batch {};
+  batch.reserve(batch_size);
+  for (size_t i = 0; i < n_payloads; ++i) {
+    Payload payload {};
+    payload.timestamp = static_cast<long>(i);
+    if (batch_size <= 1) {
+      buffer.put(std::move(payload));
+    } else {
+      batch.push_back(std::move(payload));
+      if (batch.size() == batch_size) {
+        buffer.put(batch);
+      }
+    }
+  }
+  buffer.put(batch);
+  const auto produced = Clock::now();
+  done = true;
+  consumer.join();
+  const auto consumed = Clock::now();
+
+  const auto put_time = std::chrono::duration<double>(produced - start).count();
+  const auto total_time = std::chrono::duration<double>(consumed - start).count();
+  fmt::print("{:<10} batch {:4d} | put {:7.2f} Mpackets/s | delivered {:7.2f} Mpackets/s | lost {:5.2f} %\n",
+      name, batch_size, static_cast<double>(n_payloads) / put_time * 1e-6,
+      static_cast<double>(received) / total_time * 1e-6,
+      static_cast<double>(n_payloads - received) / static_cast<double>(n_payloads) * 100.);
+}
+
+int main(int argc, const char* argv[])
+{
+  size_t n_payloads = 20000000;
+  if (argc > 1) {
+    n_payloads = std::stoul(argv[1]);
+  }
+
+  for (size_t batch_size : {1, 64}) {
+    run<FIFO<Payload>>("FIFO", n_payloads, batch_size);
+    run<SPSCQueue<Payload>>("SPSCQueue", n_payloads, batch_size);
+  }
+}
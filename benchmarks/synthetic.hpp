@@ -0,0 +1,132 @@
+#pragma once
+
+// Synthetic SAMPA data for the benchmarks, with valid Hamming codes and data parities
+
+#include <sampasrs/decoder.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace synthetic {
+
+using namespace sampasrs;
+
+inline uint64_t make_header(uint8_t queue, uint32_t bx_count, uint8_t sampa, uint8_t channel, uint16_t words, uint8_t data_parity)
+{
+  uint64_t data = uint64_t {Hit::HEADER} << 62U;
+  data |= uint64_t {queue} << 52U;
+  data |= uint64_t {data_parity} << 51U;
+  data |= uint64_t {bx_count >> 1U} << 32U;
+  data |= uint64_t {bx_count & 1U} << 29U;
+  data |= uint64_t {channel} << 24U;
+  data |= uint64_t {sampa} << 20U;
+  data |= uint64_t {words} << 10U;
+
+  // The Hamming parity bits are the first bits of the header, each one is only covered by its own mask
+  const auto& masks = Hit::hamming_masks();
+  for (size_t i = 0; i < masks.size(); ++i) {
+    data |= uint64_t {odd_parity(data & masks[i])} << i;
+  }
+  data |= uint64_t {odd_parity(data & Hit::parity_mask)} << 6U;
+  return data;
+}
+
+inline uint64_t make_data(uint8_t pk, uint8_t queue, const std::array<uint16_t, Hit::words_per_hit>& words)
+{
+  uint64_t data = uint64_t {pk} << 62U | uint64_t {queue} << 52U;
+  data |= uint64_t {words[0]} | uint64_t {words[1]} << 10U | uint64_t {words[2]} << 20U;
+  data |= uint64_t {words[3]} << 32U | uint64_t {words[4]} << 42U;
+  return data;
+}
+
+// Hits of consecutive events, the channels are spread over the 16 queues
+// Each waveform has between words and words + 6 samples
+inline std::vector<uint64_t> make_hits(size_t events, size_t channels, size_t words, uint32_t seed = 1)
+{
+  std::mt19937 random(seed);
+  std::vector<uint64_t> hits {};
+  uint32_t bx_count = 1000;
+
+  for (size_t event = 0; event < events; ++event) {
+    bx_count = (bx_count + 3 + random() % 200) & 0xfffffU;
+    for (size_t channel = 0; channel < channels; ++channel) {
+      const auto queue = static_cast<uint8_t>(channel % 16 + 1);
+      const size_t n_words = words + random() % 7;
+      const size_t n_data = (n_words + Hit::words_per_hit - 1) / Hit::words_per_hit;
+
+      std::vector<uint64_t> data {};
+      uint8_t data_parity = 0;
+      for (size_t i = 0; i < n_data; ++i) {
+        const bool last = i == n_data - 1;
+        const auto used_words = static_cast<uint8_t>(last ? n_words - Hit::words_per_hit * i : Hit::words_per_hit);
+
+        std::array<uint16_t, Hit::words_per_hit> samples {};
+        for (size_t w = 0; w < used_words; ++w) {
+          samples[w] = static_cast<uint16_t>(random() % 1024);
+        }
+        const auto hit = make_data(last ? Hit::END : Hit::DATA, queue, samples);
+        data_parity ^= Hit(hit).compute_data_parity(used_words);
+        data.push_back(hit);
+      }
+
+      hits.push_back(make_header(queue, bx_count, static_cast<uint8_t>(channel / 32), static_cast<uint8_t>(channel % 32),
+          static_cast<uint16_t>(n_words), data_parity));
+      hits.insert(hits.end(), data.begin(), data.end());
+    }
+  }
+  return hits;
+}
+
+// Split the hits in payloads as sent by the FEC
+inline std::vector<Payload> make_payloads(const std::vector<uint64_t>& hits, size_t hits_per_payload = 127, uint8_t fec_id = 1)
+{
+  std::vector<Payload> payloads {};
+  for (size_t first = 0; first < hits.size(); first += hits_per_payload) {
+    payload_data data(Payload::header_size, 0);
+    data[4] = 0x56; // VM3
+    data[5] = 0x4d;
+    data[6] = 0x33;
+    data[7] = static_cast<uint8_t>(fec_id << 4U);
+
+    const auto last = std::min(hits.size(), first + hits_per_payload);
+    for (size_t i = first; i < last; ++i) {
+      for (int byte = 7; byte >= 0; --byte) {
+        data.push_back(static_cast<uint8_t>(hits[i] >> (8 * byte)));
+      }
+    }
+    payloads.emplace_back(std::move(data));
+  }
+  return payloads;
+}
+
+// Payloads cut at any byte of the hit stream, as after a misalignment, each starting with some caca bytes
+// Payload i starts i % 8 bytes after a hit boundary, so consecutive payloads never share their alignment
+inline std::vector<Payload> make_misaligned_payloads(const std::vector<uint64_t>& hits, size_t hits_per_payload = 127)
+{
+  std::vector<uint8_t> stream {};
+  for (auto hit : hits) {
+    for (int byte = 7; byte >= 0; --byte) {
+      stream.push_back(static_cast<uint8_t>(hit >> (8 * byte)));
+    }
+  }
+
+  std::vector<Payload> payloads {};
+  const auto payload_bytes = hits_per_payload * sizeof(uint64_t);
+  for (size_t first = 0, i = 0; first + payload_bytes + 8 <= stream.size(); first += payload_bytes, ++i) {
+    const size_t cacas = 1 + i % 32;
+    payload_data data(cacas + Payload::header_size, 0);
+    std::fill_n(data.begin(), cacas, 0xca);
+    data[cacas + 4] = 0x56; // VM3
+    data[cacas + 5] = 0x4d;
+    data[cacas + 6] = 0x33;
+    data.insert(data.end(), stream.begin() + first + i % 8, stream.begin() + first + i % 8 + payload_bytes);
+    payloads.emplace_back(std::move(data));
+  }
+  return payloads;
+}
+
+} // namespace synthetic
@@ -9,11 +9,10 @@
 
 #include <sampasrs/mapping.hpp>
 #include <sampasrs/clusters.hpp>
+#include <sampasrs/waveform_reader.hpp>
 
 
 #include "TFile.h"
-#include "TTreeReader.h"
-#include "TTreeReaderArray.h"
 
 
 using namespace std;
@@ -45,11 +44,7 @@ int main(int argc, char *argv[])
   auto Clstrootfname = input_path.replace_extension("Clst.root").string();
 
   TFile file(file_name.data(), "READ");
-  TTreeReader reader("waveform", &file);
-  TTreeReaderValue<std::vector<std::vector<short>>> words(reader, "words"); // template type must match datatype
-  TTreeReaderArray<short> sampa(reader, "sampa");
-  TTreeReaderArray<short> channel(reader, "channel");
-  TTreeReaderArray<double> x(reader, "x");
+  sampasrs::WaveformReader reader(file); // nested or flat layout
   
 
   TFile* hfile = new TFile(Clstrootfname.c_str(),"RECREATE");
@@ -103,19 +98,22 @@ int main(int argc, char *argv[])
   std::array<double, 1024> sum_cm={};
 
   int Entries;
-  Entries = reader.GetEntries();
+  Entries = reader.entries();
 
   std::vector <Hits_evt> hits; 
   bool evt_ok=false;
  
   int event_id = 0;
 
-  while ( reader.Next() )  
+  while ( reader.next() )  
   {
     std::fill( std::begin( sum_cm ), std::end( sum_cm ), 0 );
     std::fill( std::begin( n_chns ), std::end( n_chns ), 0 );
     
-    auto& event_words = *words;
+    const auto& event_words = reader.words();
+    const auto& sampa = reader.sampa();
+    const auto& channel = reader.channel();
+    const auto& x = reader.x();
     
     //calculation of the common mode for later correction
 
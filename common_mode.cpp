@@ -6,10 +6,9 @@
 #include <fstream>
 #include <filesystem>
 
+#include <sampasrs/waveform_reader.hpp>
 
 #include "TFile.h"
-#include "TTreeReader.h"
-#include "TTreeReaderArray.h"
 #include "TGraph.h"
 
 void Map_pedestal(std::string const& pedestal_file, std::unordered_map<int, std::pair<double, double>> &my_map)
@@ -75,11 +74,7 @@ int main(int argc, char *argv[])
 
 
   TFile file(file_name.data(), "READ");
-  TTreeReader reader("waveform", &file);
-  TTreeReaderValue<std::vector<std::vector<short>>> words(reader, "words"); // template type must match datatype
-  TTreeReaderArray<short> sampa(reader, "sampa");
-  TTreeReaderArray<short> channel(reader, "channel");
-  TTreeReaderArray<double> x(reader, "x");
+  sampasrs::WaveformReader reader(file); // nested or flat layout
 
 
   std::unordered_map<int, std::pair<double, double>> map_of_pedestals = {};
@@ -110,9 +105,11 @@ int main(int argc, char *argv[])
 
  
 int event_id = 0;
-  while (reader.Next()) 
+  while (reader.next()) 
   {
-    auto& event_words = *words;
+    const auto& event_words = reader.words();
+    const auto& sampa = reader.sampa();
+    const auto& channel = reader.channel();
     // std::cout<< event_words.size() <<std::endl;
     for (size_t i = 0; i < event_words.size(); ++i) //loop nos canais
     {
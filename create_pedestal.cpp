@@ -1,4 +1,5 @@
 #include <sampasrs/root_fix.hpp>
+#include <sampasrs/waveform_reader.hpp>
 
 #include <cmath>
 #include <cstddef>
@@ -14,8 +15,6 @@
 #include <TLatex.h>
 #include <TStyle.h>
 #include <TH1D.h>
-#include <TTreeReader.h>
-#include <TTreeReaderArray.h>
 
 void make_plot(const char *filename)
     {    
@@ -119,10 +118,7 @@ int main(int argc, const char* argv[])
   
 
   TFile file(input_name, "READ");
-  TTreeReader reader("waveform", &file);
-  TTreeReaderValue<std::vector<std::vector<short>>> words(reader, "words"); // template type must match datatype
-  TTreeReaderArray<short> sampa(reader, "sampa");
-  TTreeReaderArray<short> channel(reader, "channel");
+  sampasrs::WaveformReader reader(file); // nested or flat layout
 
   struct Pedestal {
     short sampa = -1;
@@ -139,8 +135,10 @@ int main(int argc, const char* argv[])
   int hybrid;
 
   int event_id = 0;
-  while (reader.Next() && event_id < NumEvts) {
-    auto& event_words = *words;
+  while (reader.next() && event_id < NumEvts) {
+    const auto& event_words = reader.words();
+    const auto& sampa = reader.sampa();
+    const auto& channel = reader.channel();
     for (size_t i = 0; i < event_words.size(); ++i) {
       const int global_channel = (sampa[i]) * 32 + channel[i];
       auto& pedestal = channels[global_channel];
@@ -1,10 +1,12 @@
 #include <fmt/core.h>
+#include <sampasrs/acquisition.hpp>
 #include <sampasrs/utils.hpp>
 
 #include <chrono>
 #include <cstddef>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
@@ -14,7 +16,7 @@ using sc = std::chrono::steady_clock;
 int main(int argc, char* argv[])
 {
   if (argc < 2) {
-    std::cerr << "Usage: fake_packets <host> <rate in MB/s>\n";
+    std::cerr << "Usage: fake_packets <host> <rate in MB/s> [receiver file prefix]\n";
     return 1;
   }
 
@@ -23,6 +25,14 @@ int main(int argc, char* argv[])
     mb_per_second = std::stof(argv[2]);
   }
 
+  // Optionally receive the packets in this process with the UDP socket capture, sending to localhost
+  std::unique_ptr<sampasrs::Acquisition> receiver {};
+  if (argc > 3) {
+    sampasrs::Acquisition::Config config {};
+    config.capture = sampasrs::CaptureMode::Socket;
+    receiver = std::make_unique<sampasrs::Acquisition>(argv[3], true, std::nullopt, "", config);
+  }
+
   sampasrs::PacketSender sender {};
   std::cout << "Connected\n";
 
@@ -54,6 +64,15 @@ int main(int argc, char* argv[])
     if (duration.count() > 1) {
       const float rate = sent_data / duration.count();
       fmt::print("Packets sent {} - {:.1f} MB/s\n", sent_packets, rate);
+      if (receiver) {
+        const auto& stats = receiver->get_stats();
+        if (receiver->get_state() != sampasrs::Acquisition::Run) {
+          std::cerr << "Receiver stopped\n";
+          return 1;
+        }
+        fmt::print("Packets received {} - {:.1f} MB/s - Dropped {} - Write speed {:.1f} MB/s - Buffer allocations {}\n",
+            stats.total_packets, stats.read_speed, stats.dropped_packets, stats.write_speed, stats.payload_allocations);
+      }
       start = end;
       sent_data = 0;
     }
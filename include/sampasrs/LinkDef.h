@@ -1,4 +1,6 @@
 #ifdef __CLING__
 #pragma link C++ class vector < short> + ;
 #pragma link C++ class vector < vector < short>> + ;
+#pragma link C++ class vector < unsigned short> + ;
+#pragma link C++ class vector < unsigned int> + ;
 #endif
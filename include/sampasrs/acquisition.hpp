@@ -1,14 +1,19 @@
 #pragma once
 
+#include <sampasrs/capture.hpp>
 #include <sampasrs/decoder.hpp>
+#include <sampasrs/event_builder.hpp>
+#include <sampasrs/fifo.hpp>
+#include <sampasrs/pool.hpp>
 #include <sampasrs/utils.hpp>
+#include <sampasrs/writer.hpp>
 
-#include <boost/circular_buffer.hpp>
 #include <boost/histogram.hpp> // make_histogram, regular, weight, indexed
 #include <fmt/core.h>
 #include <tins/tins.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -19,6 +24,7 @@
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <numeric>
 #include <optional>
@@ -30,70 +36,46 @@
 
 namespace sampasrs {
 
-// Helper class to pass data between different threads
-template <typename T>
-class FIFO {
-  public:
-  FIFO() = default;
-
-  explicit FIFO(size_t buffer_size, size_t min_output, size_t max_output)
-  {
-    config(buffer_size, min_output, max_output);
-  }
-
-  void config(size_t buffer_size, size_t min_output, size_t max_output)
-  {
-    m_buffer.set_capacity(buffer_size);
-    m_min_output = min_output;
-    m_max_output = max_output;
-    m_output.reserve(max_output);
-  }
-
-  // Retrieve elements from the buffer
-  [[nodiscard]] std::vector<T>& get(long timeout_milliseconds = 100)
-  {
-    m_output.clear();
-
-    std::unique_lock<std::mutex> lock(m_mutex);
-    // Wait until the buffer has enough elements, then acquire the lock
-    m_buffer_ready.wait_for(lock, std::chrono::milliseconds(timeout_milliseconds), [&] {
-      return m_buffer.size() >= m_min_output;
-    });
-
-    if (!m_buffer.empty()) {
-      // Move elements to output container
-      const size_t output_payloads = std::min(m_buffer.size(), m_max_output);
-      for (int i = 0; i < output_payloads; ++i) {
-        m_output.emplace_back(std::move(m_buffer.front()));
-        m_buffer.pop_front();
-      }
-    }
-    return m_output;
-  }
-
-  const boost::circular_buffer<T>& get_buffer() const { return m_buffer; };
-
-  void put(T&& element)
-  {
-    {
-      std::lock_guard<std::mutex> lock(m_mutex);
-      m_buffer.push_back(std::move(element));
-    }
-    m_buffer_ready.notify_all();
-  }
-
-  size_t size() const { return m_buffer.size(); }
-  size_t capacity() const { return m_buffer.capacity(); }
-  bool empty() const { return size() == 0; }
-  bool enable() const { return capacity() != 0; }
-
-  private:
-  boost::circular_buffer<T> m_buffer {};
-  std::vector<T> m_output {};
-  std::condition_variable m_buffer_ready {};
-  std::mutex m_mutex {};
-  size_t m_min_output {};
-  size_t m_max_output {};
+// Optional acquisition settings
+struct AcquisitionConfig {
+  CaptureMode capture = CaptureMode::Sniffer;
+  int receive_buffer_size = 64 << 20; // UDP socket buffer in bytes, CaptureMode::Socket only
+
+  // What each pipeline buffer does when it is full
+  Overflow reader_overflow = Overflow::DropNewest;  // network payloads, the reader must never wait
+  Overflow payload_overflow = Overflow::DropOldest; // stored payloads on their way to the decoder
+  Overflow decoder_overflow = Overflow::Block;      // decoded events waiting to be stored
+  Overflow event_overflow = Overflow::DropOldest;   // events for the event handler
+
+  // Payload buffers preallocated by the reader and recycled after decoding
+  size_t payload_pool_size = 16384;
+  size_t payload_buffer_capacity = 9000; // bytes, enough for jumbo frames
+
+  // Incomplete events are finished, and marked MissingPayload, once they are too old, 0 disables each limit
+  std::chrono::microseconds max_event_age = std::chrono::seconds(1); // by payload timestamps
+  uint32_t max_event_bx_distance = 0;                                // bx counts behind the last header
+
+  // Decoder threads, each FEC is always decoded by the same thread so more threads only help with many FECs
+  // At most one thread per FEC is started, with a single FEC keep 1: more only add a hand over between threads
+  size_t decoder_threads = 1;
+
+  // Merge the events of all FECs with the same bx_count before the event handler
+  // The stored files keep one event per FEC
+  bool build_events = false;
+  EventBuilderConfig event_builder {};
+
+  // How the raw and event files are written
+  WriterBackend writer = WriterBackend::Stream;
+  BlockWriter::Config block_writer {};
+
+  // Spread the output over these directories, usually on different disks, instead of the file prefix directory
+  // With more than one, the data is cut in stripes written round robin and a {prefix}.raw.manifest lists them in order
+  std::vector<std::string> output_directories {};
+  // Each directory has room for a whole stripe in memory, (stripe_size / block_size + 1) blocks: 72 MiB by default
+  size_t stripe_size = 64U << 20U; // bytes
+
+  // Write .iraw and .irawev files with a block index for random access, see raw_file.hpp
+  bool indexed_files = false;
 };
 
 // Network sniffer and raw data store
@@ -101,19 +83,24 @@ class Acquisition {
   public:
   using fast_clock = std::chrono::high_resolution_clock;
   using Clock = std::chrono::steady_clock;
+  using Config = AcquisitionConfig;
 
   explicit Acquisition(const std::string& file_prefix, bool save_raw = true,
       const std::optional<std::function<void(Event&&)>>& event_handler = {},
-      const std::string& fec_address = "10.0.0.2")
+      const std::string& fec_address = "10.0.0.2",
+      const Config& config = {})
       : m_file_prefix(file_prefix)
       , m_fec_address(fec_address)
+      , m_config(config)
   {
     const auto save = save_raw ? Store::Raw : Store::Event;
     start(save, event_handler);
   }
 
-  explicit Acquisition(const std::function<void(Event&&)>& event_handler, const std::string& fec_address = "10.0.0.2")
+  explicit Acquisition(const std::function<void(Event&&)>& event_handler, const std::string& fec_address = "10.0.0.2",
+      const Config& config = {})
       : m_fec_address(fec_address)
+      , m_config(config)
   {
     start(Store::Raw, event_handler);
   }
@@ -138,13 +125,14 @@ class Acquisition {
       }
     }
 
-    // Send packet to unblock the sniffer's loop
+    // Send packet to unblock the sniffer's loop, the other capture modes wake up periodically
     // TODO: find a less hacky way to break this
-    if (m_pipeline.back().joinable()) {
+    if (m_pipeline.back().joinable() && m_config.capture == CaptureMode::Sniffer) {
       Tins::PacketSender sender;
       auto pkt = Tins::IP("10.0.0.3", m_fec_address) / Tins::UDP(6006) / Tins::RawPDU("tchau");
       sender.send(pkt);
-
+    }
+    if (m_pipeline.back().joinable()) {
       m_pipeline.back().join(); // reader thread
     }
   }
@@ -152,6 +140,9 @@ class Acquisition {
   struct ReadStats {
     size_t bytes = 0;
     size_t packets = 0;
+    size_t dropped = 0; // packets lost before reaching the reader (capture modes with kernel statistics only)
+    size_t allocations = 0; // payload buffers allocated because the pool was empty, filled by update_stats
+    size_t reuses = 0;      // payload buffers recycled from the pool, filled by update_stats
     size_t buffer_items = 0;
     size_t buffer_size = 0;
     Clock::duration total_time {};
@@ -162,6 +153,8 @@ class Acquisition {
     size_t bytes = 0;
     size_t valid_events = 0;
     size_t total_events = 0;
+    size_t evicted_events = 0; // incomplete events flushed by the assembler
+    size_t event_memory = 0;   // bytes held by the events being assembled
     Clock::duration total_time {};
     Clock::duration process_time {};
   };
@@ -174,6 +167,12 @@ class Acquisition {
     Clock::duration process_time {};
   };
 
+  struct BufferStats {
+    size_t items = 0;
+    size_t capacity = 0;
+    size_t dropped = 0; // elements discarded because the buffer was full
+  };
+
   struct Stats {
     ReadStats read {};
     DecodeStats decode {};
@@ -196,9 +195,24 @@ class Acquisition {
     float decode_load {}; // %
     float write_load {};  // %
 
-    size_t total_packets {}; // received network packets
+    size_t total_packets {};   // received network packets
+    size_t dropped_packets {}; // network packets lost before reaching the reader
+
+    size_t payload_allocations {};    // payload buffers allocated since the start
+    float payload_allocation_rate {}; // allocations / second, zero once the pool is warm
+    float event_pool_hit_rate {};     // % of new events that reused the memory of a processed one
+    float event_memory {};            // in MB, events being assembled plus the event pool
+
+    BufferStats reader_buffer {};  // network payloads
+    BufferStats payload_buffer {}; // stored payloads to the decoder
+    BufferStats decoder_buffer {}; // decoded events to the writer
+    BufferStats event_buffer {};   // events to the event handler
+    size_t dropped_payloads {};    // payloads discarded by full buffers
+    size_t dropped_events {};      // valid events discarded by full buffers
     size_t valid_events {};
     size_t total_events {};
+    size_t evicted_events {}; // incomplete events finished because they were too old
+    size_t incomplete_built_events {}; // events built without some FECs, Config::build_events only
   };
 
   enum State : unsigned char {
@@ -208,6 +222,7 @@ class Acquisition {
     WriteErrorFileExists = 1U << 2U,
     WriteErrorDirDontExists = 1U << 3U,
     WriteErrorOpenFile = 1U << 4U,
+    WriteError = 1U << 5U,
   };
 
   const Stats& get_stats() const { return m_stats; }
@@ -220,7 +235,9 @@ class Acquisition {
     const auto dt = std::chrono::duration<float>(now - m_stats.last).count();
 
     // Current stats value
-    const auto read = m_read_stats;
+    auto read = m_read_stats;
+    read.allocations = m_payload_pool.allocations();
+    read.reuses = m_payload_pool.reuses();
     const auto write = m_write_stats;
     const auto decode = m_decoder_stats;
 
@@ -247,8 +264,22 @@ class Acquisition {
         / (std::chrono::duration<float>(write.total_time - m_stats.write.total_time).count() + eps) * 100.f;
 
     m_stats.total_packets = read.packets;
+    m_stats.dropped_packets = read.dropped;
+    m_stats.payload_allocations = read.allocations;
+    m_stats.payload_allocation_rate = static_cast<float>(read.allocations - m_stats.read.allocations) / dt;
+    m_stats.event_pool_hit_rate = m_event_pool.hit_rate();
+    m_stats.event_memory = static_cast<float>(decode.event_memory + m_event_pool.memory_use()) * to_mb;
     m_stats.valid_events = decode.valid_events;
     m_stats.total_events = decode.total_events;
+    m_stats.evicted_events = decode.evicted_events;
+    m_stats.incomplete_built_events = m_incomplete_built_events.load(std::memory_order_relaxed);
+
+    m_stats.reader_buffer = buffer_stats(m_reader_buffer);
+    m_stats.payload_buffer = buffer_stats(m_tmp_payload_buffer);
+    m_stats.decoder_buffer = buffer_stats(m_decoder_buffer);
+    m_stats.event_buffer = buffer_stats(m_out_event_buffer);
+    m_stats.dropped_payloads = m_stats.reader_buffer.dropped + m_stats.payload_buffer.dropped;
+    m_stats.dropped_events = m_stats.decoder_buffer.dropped + m_stats.event_buffer.dropped;
 
     // Update cache
     m_stats.read = read;
@@ -257,6 +288,12 @@ class Acquisition {
     m_stats.last = now;
   }
 
+  template <typename Buffer>
+  static BufferStats buffer_stats(const Buffer& buffer)
+  {
+    return {buffer.size(), buffer.capacity(), buffer.dropped()};
+  }
+
   enum class Store {
     None,
     Raw,
@@ -266,27 +303,36 @@ class Acquisition {
   void start(Store store, const std::optional<std::function<void(Event&&)>>& event_handler = {})
   {
     // Start data aquisition and processing
+    const auto& config = m_config;
+    m_payload_pool.config(config.payload_pool_size, config.payload_buffer_capacity);
+    // Payloads and events dropped by a full buffer go back to the pools
+    const auto recycle_payload = [this](Payload&& payload) { m_payload_pool.release(std::move(payload.data)); };
+    const auto recycle_event = [this](Event&& event) { m_event_pool.release(std::move(event)); };
+    m_reader_buffer.set_recycler(recycle_payload);
+    m_tmp_payload_buffer.set_recycler(recycle_payload);
+    m_decoder_buffer.set_recycler(recycle_event);
+    m_out_event_buffer.set_recycler(recycle_event);
     switch (store) {
     case Store::None:
-      m_reader_buffer.config(100000, 50, 10000);
-      m_out_event_buffer.config(10000, 10, 1000);
+      m_reader_buffer.config(100000, 50, 10000, config.reader_overflow);
+      m_out_event_buffer.config(10000, 10, 1000, config.event_overflow);
 
       m_pipeline.emplace_back(&Acquisition::decoder_task, this, std::ref(m_reader_buffer), std::ref(m_out_event_buffer));
       break;
 
     case Store::Raw:
-      m_reader_buffer.config(2000000, 50, 10000);
-      m_tmp_payload_buffer.config(100000, 50, 100);
-      m_out_event_buffer.config(1000, 10, 100);
+      m_reader_buffer.config(2000000, 50, 10000, config.reader_overflow);
+      m_tmp_payload_buffer.config(100000, 50, 100, config.payload_overflow);
+      m_out_event_buffer.config(1000, 10, 100, config.event_overflow);
 
       m_pipeline.emplace_back(&Acquisition::writer_task<Payload>, this, std::ref(m_reader_buffer), std::ref(m_tmp_payload_buffer));
       m_pipeline.emplace_back(&Acquisition::decoder_task, this, std::ref(m_tmp_payload_buffer), std::ref(m_out_event_buffer));
       break;
 
     case Store::Event:
-      m_reader_buffer.config(100000, 50, 10000);
-      m_decoder_buffer.config(100000, 10, 1000);
-      m_out_event_buffer.config(10000, 10, 1000);
+      m_reader_buffer.config(100000, 50, 10000, config.reader_overflow);
+      m_decoder_buffer.config(100000, 10, 1000, config.decoder_overflow);
+      m_out_event_buffer.config(10000, 10, 1000, config.event_overflow);
 
       m_pipeline.emplace_back(&Acquisition::decoder_task, this, std::ref(m_reader_buffer), std::ref(m_decoder_buffer));
       m_pipeline.emplace_back(&Acquisition::writer_task<Event>, this, std::ref(m_decoder_buffer), std::ref(m_out_event_buffer));
@@ -295,15 +341,33 @@ class Acquisition {
 
     if (event_handler.has_value()) {
       m_pipeline.emplace_back(&Acquisition::event_handler_task, this, std::ref(m_out_event_buffer), event_handler.value());
+    } else {
+      // Nobody reads the events, don't count them as lost
+      m_out_event_buffer.config(0, 0, 0);
     }
 
     m_pipeline.emplace_back(&Acquisition::reader_task, this, std::ref(m_reader_buffer));
   }
 
-  void reader_task(FIFO<Payload>& output)
+  void reader_task(SPSCQueue<Payload>& output)
+  {
+    switch (m_config.capture) {
+    case CaptureMode::Sniffer:
+      sniffer_reader(output);
+      break;
+    case CaptureMode::PacketMmap:
+      packet_ring_reader(output);
+      break;
+    case CaptureMode::Socket:
+      socket_reader(output);
+      break;
+    }
+  }
+
+  // Find interface do listen
+  std::string capture_interface() const
   {
     using namespace Tins;
-    // Find interface do listen
     NetworkInterface iface;
     if (m_fec_address.empty()) {
       iface = NetworkInterface::default_interface().name();
@@ -312,15 +376,22 @@ class Acquisition {
       iface = NetworkInterface(to_resolve).name();
     }
     std::wcout << "Listening to interface: " << iface.friendly_name() << "\n";
+    return iface.name();
+  }
+
+  static constexpr const char* capture_filter = "udp port 6006 and dst host 10.0.0.3";
+
+  void sniffer_reader(SPSCQueue<Payload>& output)
+  {
+    using namespace Tins;
 
     // Sniff on interface
-    static const char* filter = "udp port 6006 and dst host 10.0.0.3";
     SnifferConfiguration config;
-    config.set_filter(filter);
+    config.set_filter(capture_filter);
 
     try {
       // Wont work without raw packet reading permission
-      Sniffer sniffer(iface.name(), config);
+      Sniffer sniffer(capture_interface(), config);
       sniffer.set_timeout(10);
 
       m_read_stats.buffer_size = output.capacity();
@@ -336,7 +407,9 @@ class Acquisition {
         }
         m_read_stats.bytes += packet.pdu()->size();
 
-        Payload payload(std::move(packet));
+        // Copy to a pooled buffer, the packet memory is freed by this thread
+        const auto& raw = packet.pdu()->rfind_pdu<RawPDU>().payload();
+        Payload payload(m_payload_pool.acquire(raw.data(), raw.size()), std::chrono::microseconds(packet.timestamp()).count());
         ++m_read_stats.packets;
 
         output.put(std::move(payload));
@@ -355,23 +428,135 @@ class Acquisition {
     }
   }
 
-  void decoder_task(FIFO<Payload>& input, FIFO<Event>& output)
+  void packet_ring_reader(SPSCQueue<Payload>& output)
+  {
+#ifdef __linux__
+    try {
+      // Wont work without raw packet reading permission
+      PacketRing ring(capture_interface(), capture_filter);
+      static constexpr int poll_timeout_ms = 10;
+
+      m_read_stats.buffer_size = output.capacity();
+      std::vector<Payload> block_payloads {};
+      Timer stats_timer(std::chrono::milliseconds(500)); // kernel statistics update interval
+
+      while (m_state == Run) {
+        const auto start = Clock::now();
+        const bool ready = ring.wait_block(poll_timeout_ms);
+        const auto start_process = Clock::now();
+
+        if (ready) {
+          ring.consume_block([&](const PacketRing::Frame& frame) {
+            m_read_stats.bytes += frame.size;
+            block_payloads.emplace_back(m_payload_pool.acquire(frame.data, frame.size), frame.timestamp);
+          });
+          m_read_stats.packets += block_payloads.size();
+
+          // The entire block goes to the pipeline at once
+          output.put(block_payloads);
+          m_read_stats.buffer_items = output.size();
+        }
+
+        if (stats_timer) {
+          m_read_stats.dropped = ring.stats().drops;
+        }
+
+        const auto end = Clock::now();
+        m_read_stats.total_time += end - start;
+        m_read_stats.process_time += end - start_process;
+      }
+      m_read_stats.dropped = ring.stats().drops;
+    } catch (const std::runtime_error& error) {
+      std::cerr << "Error: " << error.what() << ", try running as root\n"
+                << "\n";
+      m_state |= Stop | ReadError;
+    }
+#else
+    std::cerr << "Error: memory-mapped capture is only available on Linux\n";
+    m_state |= Stop | ReadError;
+#endif
+  }
+
+  void socket_reader(SPSCQueue<Payload>& output)
+  {
+#ifdef __linux__
+    try {
+      UdpReceiver::Config config {};
+      config.receive_buffer_size = m_config.receive_buffer_size;
+      UdpReceiver receiver(config);
+      std::cout << "Listening to UDP port " << config.port << ", socket buffer " << receiver.receive_buffer_size() / 2 << " bytes\n";
+      static constexpr int poll_timeout_ms = 10;
+
+      m_read_stats.buffer_size = output.capacity();
+      std::vector<Payload> batch_payloads {};
+
+      while (m_state == Run) {
+        const auto start = Clock::now();
+        const bool ready = receiver.wait(poll_timeout_ms);
+        const auto start_process = Clock::now();
+
+        if (ready) {
+          receiver.receive_batch([&](const UdpReceiver::Datagram& datagram) {
+            m_read_stats.bytes += datagram.size;
+            batch_payloads.emplace_back(m_payload_pool.acquire(datagram.data, datagram.size), datagram.timestamp);
+          });
+          m_read_stats.packets += batch_payloads.size();
+          m_read_stats.dropped = receiver.stats().drops;
+
+          output.put(batch_payloads);
+          m_read_stats.buffer_items = output.size();
+        }
+
+        const auto end = Clock::now();
+        m_read_stats.total_time += end - start;
+        m_read_stats.process_time += end - start_process;
+      }
+    } catch (const std::runtime_error& error) {
+      std::cerr << "Error: " << error.what() << "\n";
+      m_state |= Stop | ReadError;
+    }
+#else
+    std::cerr << "Error: socket capture is only available on Linux\n";
+    m_state |= Stop | ReadError;
+#endif
+  }
+
+  // Assembler with the acquisition settings, new streams copy it
+  template <typename Handler>
+  auto make_assembler(Handler event_handler)
+  {
+    auto sorter = make_event_assembler(std::move(event_handler));
+    sorter.enable_header_fix = false;
+    sorter.enable_remove_caca = true;
+    sorter.process_invalid_events = true;
+    sorter.event_pool = &m_event_pool;
+    sorter.max_event_age = m_config.max_event_age;
+    sorter.max_bx_distance = m_config.max_event_bx_distance;
+    return sorter;
+  }
+
+  void decoder_task(SPSCQueue<Payload>& input, SPSCQueue<Event>& output)
   {
+    if (m_config.decoder_threads > 1) {
+      parallel_decoder_task(input, output);
+      return;
+    }
+
+    ConsumerGuard consumer(input);
     auto event_handler = [&](Event&& event) {
       ++m_decoder_stats.total_events;
       m_decoder_stats.bytes += event.byte_size();
 
       if (event.valid()) {
         ++m_decoder_stats.valid_events;
-        output.put(std::move(event));
+        if (output.enable()) {
+          output.put(std::move(event));
+        }
       }
     };
     Timer stats_timer(std::chrono::milliseconds(1000)); // Stats update interval
 
-    EventAssembler sorter(event_handler);
-    sorter.enable_header_fix = false;
-    sorter.enable_remove_caca = true;
-    sorter.process_invalid_events = true;
+    BasicStreamAssembler sorter(make_assembler(event_handler));
 
     while (m_state == Run || !input.empty()) {
       const auto start = Clock::now();
@@ -381,6 +566,8 @@ class Acquisition {
       for (auto& payload : payloads) {
         sorter.process(payload);
       }
+      // Give the buffers back to the reader
+      recycle(payloads);
 
       const auto end = Clock::now();
       m_decoder_stats.total_time += end - start;
@@ -388,133 +575,316 @@ class Acquisition {
 
       // Update stats
       if (stats_timer) {
+        m_decoder_stats.evicted_events = sorter.get_evicted_events();
+        m_decoder_stats.event_memory = sorter.memory_use();
         update_stats();
       }
     }
   }
 
+  // Split the payloads between decoder workers by FEC, their events are merged back into output
+  // A worker is started for each new FEC, up to decoder_threads, so there are never more workers than FECs.
+  // The FECs are then spread over the workers in the order they appear. One FEC is always decoded by one
+  // worker, so a single FEC gets no speedup, only the cost of handing its payloads over: use one thread then.
+  void parallel_decoder_task(SPSCQueue<Payload>& input, SPSCQueue<Event>& output)
+  {
+    ConsumerGuard consumer(input);
+    const auto max_workers = std::min(m_config.decoder_threads, StreamAssembler::max_streams);
+
+    // The workers must not drop payloads, the input buffer already applies the overflow policy
+    std::vector<std::unique_ptr<SPSCQueue<Payload>>> worker_buffers {};
+    std::vector<std::vector<Payload>> worker_payloads {};
+    std::vector<std::thread> workers {};
+    std::atomic_bool done {false};
+    std::array<size_t, StreamAssembler::max_streams> stream_worker {};
+    size_t streams = 0;
+    stream_worker.fill(max_workers); // no worker yet
+
+    const auto worker_of = [&](const Payload& payload) {
+      auto& worker = stream_worker[StreamAssembler::stream_id(payload)];
+      if (worker == max_workers) {
+        worker = streams++ % max_workers;
+        if (worker == workers.size()) {
+          {
+            std::lock_guard<std::mutex> lock(m_worker_stats_mutex);
+            m_worker_stats.emplace_back();
+          }
+          worker_buffers.push_back(std::make_unique<SPSCQueue<Payload>>(10000, 1, 1000, Overflow::Block));
+          worker_payloads.emplace_back();
+          workers.emplace_back(&Acquisition::decoder_worker, this, worker, std::ref(*worker_buffers.back()), std::ref(output), std::cref(done));
+        }
+      }
+      return worker;
+    };
+
+    Timer stats_timer(std::chrono::milliseconds(1000)); // Stats update interval
+
+    while (m_state == Run || !input.empty()) {
+      auto& payloads = input.get();
+      for (auto& payload : payloads) {
+        worker_payloads[worker_of(payload)].push_back(std::move(payload));
+      }
+      for (size_t i = 0; i < workers.size(); ++i) {
+        worker_buffers[i]->put(worker_payloads[i]);
+      }
+
+      if (stats_timer) {
+        merge_worker_stats();
+        update_stats();
+      }
+    }
+
+    done = true;
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    merge_worker_stats();
+  }
+
+  void decoder_worker(size_t id, SPSCQueue<Payload>& input, SPSCQueue<Event>& output, const std::atomic_bool& done)
+  {
+    ConsumerGuard consumer(input);
+    DecodeStats stats {};
+    std::vector<Event> events {};
+    auto event_handler = [&](Event&& event) {
+      ++stats.total_events;
+      stats.bytes += event.byte_size();
+
+      if (event.valid()) {
+        ++stats.valid_events;
+        if (output.enable()) {
+          events.push_back(std::move(event));
+        }
+      }
+    };
+
+    BasicStreamAssembler sorter(make_assembler(event_handler));
+
+    while (!done || !input.empty()) {
+      const auto start = Clock::now();
+      auto& payloads = input.get();
+      const auto start_process = Clock::now();
+
+      for (auto& payload : payloads) {
+        sorter.process(payload);
+      }
+      recycle(payloads);
+
+      const auto end = Clock::now();
+      stats.total_time += end - start;
+      stats.process_time += end - start_process;
+      stats.evicted_events = sorter.get_evicted_events();
+      stats.event_memory = sorter.memory_use();
+
+      {
+        std::lock_guard<std::mutex> lock(m_worker_stats_mutex);
+        m_worker_stats[id] = stats;
+      }
+
+      // Merge the events of all workers, the output buffer has a single producer
+      // It may block when full, so only the other workers wait for it, not the stats
+      std::lock_guard<std::mutex> lock(m_decoder_output_mutex);
+      output.put(events);
+    }
+  }
+
+  // Decoder stats of all workers, the load is their average
+  void merge_worker_stats()
+  {
+    std::vector<DecodeStats> worker_stats {};
+    {
+      std::lock_guard<std::mutex> lock(m_worker_stats_mutex);
+      worker_stats = m_worker_stats;
+    }
+    DecodeStats total {};
+    for (const auto& stats : worker_stats) {
+      total.bytes += stats.bytes;
+      total.valid_events += stats.valid_events;
+      total.total_events += stats.total_events;
+      total.evicted_events += stats.evicted_events;
+      total.event_memory += stats.event_memory;
+      total.total_time += stats.total_time;
+      total.process_time += stats.process_time;
+    }
+    m_decoder_stats = total;
+  }
+
   std::string next_file_name(std::string_view extension = "raw", bool increment = true)
   {
-    auto file_name = fmt::format("{}-{:04d}.{}", m_file_prefix, m_file_count, extension);
-    if (increment) {
-      ++m_file_count;
+    const int count = increment ? m_file_count++ : m_file_count.load();
+    return fmt::format("{}-{:04d}.{}", m_file_prefix, count, extension);
+  }
+
+  template <typename T>
+  std::string_view file_extension() const
+  {
+    if constexpr (std::is_same<T, Payload>::value) {
+      return m_config.indexed_files ? "iraw" : "raw";
     }
-    return file_name;
+    return m_config.indexed_files ? "irawev" : "rawev";
   }
 
   template <typename T>
   std::string next_file_name(bool increment = true)
   {
-    if constexpr (std::is_same<T, Payload>::value) {
-      return next_file_name("raw", increment);
+    return next_file_name(file_extension<T>(), increment);
+  }
+
+  // File of a striping target, in its output directory, the numbering is shared by all targets
+  template <typename T>
+  std::string next_target_file_name(size_t target)
+  {
+    auto file_name = next_file_name<T>();
+    if (m_config.output_directories.empty()) {
+      return file_name;
     }
-    return next_file_name("rawev", increment);
+    const auto directory = std::filesystem::path(m_config.output_directories[target]);
+    return (directory / std::filesystem::path(file_name).filename()).string();
   }
 
   template <typename T>
-  void writer_task(FIFO<T>& input, FIFO<T>& output)
+  void writer_task(SPSCQueue<T>& input, SPSCQueue<T>& output)
   {
+    ConsumerGuard consumer(input);
     m_write_stats.buffer_size = input.capacity();
-    const size_t max_file_size = size_t(2) << 30U; // ~2 GB in bytes
-    auto file_size = std::numeric_limits<unsigned int>::max();
+    StripedOutput::Config output_config {};
+    output_config.max_file_size = size_t(2) << 30U; // ~2 GB in bytes
+    output_config.stripe_size = m_config.stripe_size;
+    output_config.file = {m_config.writer, m_config.block_writer, 0};
+    if (m_config.indexed_files) {
+      output_config.indexed = raw_file::record_type<T>();
+    }
 
-    std::ofstream file;
+    const auto print_file_name = [this](const OutputFile& file) {
+      fmt::print("Writing to {}\n", file.name());
+      if (m_config.writer == WriterBackend::IoUring && !file.uses_io_uring()) {
+        fmt::print("io_uring not available, writing with a background thread\n");
+      }
+    };
 
-    while (m_state == Run || !input.empty()) {
-      // Create a new file if the previous one exceeded the max size
-      if (file_size > max_file_size) {
-        if (file.is_open()) {
-          file.close();
-        }
-        file_size = 0;
+    try {
+      // The next files are created and preallocated in the background, the full ones are closed there too
+      const auto targets = std::max<size_t>(m_config.output_directories.size(), 1);
+      const auto manifest_name = fmt::format("{}.{}.manifest", m_file_prefix, file_extension<T>());
+      StripedOutput files(targets, [this](size_t target) { return next_target_file_name<T>(target); },
+          manifest_name, output_config, print_file_name);
 
-        auto file_name = next_file_name<T>();
-        fmt::print("Writing to {}\n", file_name);
-        const auto path = std::filesystem::absolute(file_name);
+      while (m_state == Run || !input.empty()) {
+        const auto start = Clock::now();
+        auto& data = input.get();
+        const auto start_process = Clock::now();
 
-        if (std::filesystem::exists(path)) {
-          std::cerr << "Error: File \"" << file_name << "\" exists.\n";
-          m_state |= Stop | WriteErrorFileExists;
-          return;
+        if (data.empty()) {
+          continue;
         }
 
-        if (!std::filesystem::is_directory(path.parent_path())) {
-          std::cerr << "Error: Directory " << path.parent_path() << "don't exists\n";
-          m_state |= Stop | WriteErrorDirDontExists;
-          return;
-        }
+        auto writing_timer = fast_clock::now();
+        for (const auto& x : data) {
+          m_write_stats.bytes += x.byte_size();
 
-        file.open(file_name, std::ios::binary);
-        if (!file) {
-          std::cerr << "Error: Unable to create output file, check if the directory exists and you have permission to write to it.\n";
-          m_state |= Stop | WriteErrorOpenFile;
-          return;
+          // Write to file
+          files.write(x);
         }
-      }
 
-      const auto start = Clock::now();
-      auto& data = input.get();
-      const auto start_process = Clock::now();
-
-      if (data.empty()) {
-        continue;
-      }
-
-      auto writing_timer = fast_clock::now();
-      for (const auto& x : data) {
-
-        auto data_size = x.byte_size();
-        m_write_stats.bytes += data_size;
-        file_size += data_size;
+        if (output.enable()) {
+          for (auto& x : data) {
+            output.put(std::move(x));
+          }
+        } else {
+          recycle(data);
+        }
 
-        // Write to file
-        x.write(file);
-      }
+        m_write_stats.buffer_items = input.size();
+        files.check_errors();
 
-      if (output.enable()) {
-        for (auto& x : data) {
-          output.put(std::move(x));
-        }
+        const auto end = Clock::now();
+        m_write_stats.total_time += end - start;
+        m_write_stats.process_time += end - start_process;
       }
 
-      m_write_stats.buffer_items = input.size();
+      files.close();
+    } catch (const OutputFileError& error) {
+      std::cerr << "Error: " << error.what() << "\n";
+      m_state |= Stop | write_error(error.reason());
+    }
+  }
 
-      const auto end = Clock::now();
-      m_write_stats.total_time += end - start;
-      m_write_stats.process_time += end - start_process;
+  static State write_error(OutputFileError::Reason reason)
+  {
+    switch (reason) {
+    case OutputFileError::Exists:
+      return WriteErrorFileExists;
+    case OutputFileError::NoDirectory:
+      return WriteErrorDirDontExists;
+    case OutputFileError::Open:
+      return WriteErrorOpenFile;
+    case OutputFileError::Write:
+      break;
     }
+    return WriteError;
   }
 
-  void event_handler_task(FIFO<Event>& input, const std::function<void(Event&&)>& event_handle) const
+  void event_handler_task(SPSCQueue<Event>& input, const std::function<void(Event&&)>& event_handle)
   {
+    ConsumerGuard consumer(input);
     const auto get_timeout = std::chrono::milliseconds(100); // Max interval between event processes
+
+    std::optional<EventBuilder> builder {};
+    if (m_config.build_events) {
+      builder.emplace(event_handle, m_config.event_builder);
+    }
+
     while (m_state == Run || !input.empty()) {
       auto& events = input.get(get_timeout.count());
 
       // Process events data
       for (auto&& event : events) {
-        event_handle(std::move(event));
+        if (builder) {
+          builder->add(std::move(event));
+        } else {
+          event_handle(std::move(event));
+        }
+      }
+      // Events left behind by the handler are reused by the decoder
+      recycle(events);
+
+      if (builder) {
+        m_incomplete_built_events.store(builder->get_incomplete_events(), std::memory_order_relaxed);
       }
     }
+
+    if (builder) {
+      builder->flush();
+    }
   }
 
+  void recycle(std::vector<Payload>& payloads) { m_payload_pool.release(payloads); }
+  void recycle(std::vector<Event>& events) { m_event_pool.release(events); }
+
   std::string m_file_prefix {};
   std::string m_fec_address {};
+  Config m_config {};
 
   ReadStats m_read_stats {};
   DecodeStats m_decoder_stats {};
+  std::vector<DecodeStats> m_worker_stats {}; // parallel decoder, protected by m_worker_stats_mutex
+  std::mutex m_worker_stats_mutex {};
+  std::mutex m_decoder_output_mutex {}; // parallel decoder workers share the output buffer
   WriteStats m_write_stats {};
   Stats m_stats {};
+  std::atomic<size_t> m_incomplete_built_events {0}; // filled by the event handler thread
 
-  int m_file_count = 0;
+  std::atomic<int> m_file_count {0}; // shared by the striping targets
   std::atomic_uchar m_state = 0;
 
   // Define data pipeline and buffers
   std::vector<std::thread> m_pipeline {};
-  FIFO<Payload> m_reader_buffer {};
-  FIFO<Event> m_decoder_buffer {};
-  FIFO<Payload> m_tmp_payload_buffer {};
-  FIFO<Event> m_out_event_buffer {};
+  BufferPool m_payload_pool {};
+  EventPool m_event_pool {};
+  SPSCQueue<Payload> m_reader_buffer {};
+  SPSCQueue<Event> m_decoder_buffer {};
+  SPSCQueue<Payload> m_tmp_payload_buffer {};
+  SPSCQueue<Event> m_out_event_buffer {};
 };
 
 } // namespace sampasrs
@@ -0,0 +1,462 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#ifdef WITH_LIBPCAP
+#include <pcap.h>
+#endif
+
+namespace sampasrs {
+
+// How the acquisition reads the UDP packets sent by the FEC
+enum class CaptureMode {
+  Sniffer,    // libpcap through libtins, one syscall and one allocation per packet
+  PacketMmap, // AF_PACKET TPACKET_V3 memory-mapped ring, whole blocks of packets per wake up
+  Socket,     // Plain UDP socket drained with recvmmsg, doesn't need special permissions
+};
+
+inline std::optional<CaptureMode> capture_mode_from_string(std::string_view name)
+{
+  if (name == "sniffer" || name.empty()) {
+    return CaptureMode::Sniffer;
+  }
+  if (name == "mmap") {
+    return CaptureMode::PacketMmap;
+  }
+  if (name == "socket") {
+    return CaptureMode::Socket;
+  }
+  return {};
+}
+
+// Locate the UDP payload inside an Ethernet frame
+// Returns false if the frame is not an unfragmented IPv4/UDP datagram
+inline bool udp_payload(const uint8_t* frame, size_t frame_size, const uint8_t*& payload, size_t& payload_size)
+{
+  static constexpr size_t ethernet_header = 14;
+  static constexpr size_t vlan_tag = 4;
+  static constexpr size_t udp_header = 8;
+  static constexpr uint16_t ether_type_ipv4 = 0x0800;
+  static constexpr uint16_t ether_type_vlan = 0x8100;
+  static constexpr uint8_t protocol_udp = 17;
+
+  size_t offset = ethernet_header;
+  if (frame_size < offset) {
+    return false;
+  }
+  auto ether_type = static_cast<uint16_t>(frame[12] << 8U | frame[13]);
+  while (ether_type == ether_type_vlan && frame_size >= offset + vlan_tag) {
+    ether_type = static_cast<uint16_t>(frame[offset + 2] << 8U | frame[offset + 3]);
+    offset += vlan_tag;
+  }
+  if (ether_type != ether_type_ipv4 || frame_size < offset + 20) {
+    return false;
+  }
+
+  const uint8_t* ip = frame + offset;
+  const size_t ip_header = (ip[0] & 0x0fU) * 4U;
+  const bool fragmented = ((ip[6] & 0x3fU) | ip[7]) != 0; // more fragments flag or fragment offset
+  if (ip[9] != protocol_udp || fragmented || frame_size < offset + ip_header + udp_header) {
+    return false;
+  }
+
+  const uint8_t* udp = ip + ip_header;
+  const size_t udp_size = static_cast<size_t>(udp[4] << 8U | udp[5]);
+  const size_t available = frame_size - offset - ip_header;
+  if (udp_size < udp_header || udp_size > available) {
+    return false;
+  }
+
+  payload = udp + udp_header;
+  payload_size = udp_size - udp_header;
+  return true;
+}
+
+#ifdef __linux__
+
+// Packet capture through a TPACKET_V3 memory-mapped ring
+// The kernel fills fixed size blocks with frames and hands over whole blocks
+// at once, so the reader only wakes up once per block instead of once per packet.
+// see: https://docs.kernel.org/networking/packet_mmap.html
+class PacketRing {
+  public:
+  struct Config {
+    unsigned int block_size = 1U << 20U; // bytes, must be a multiple of the page size
+    unsigned int block_count = 64;
+    unsigned int frame_size = 2048;     // only used by the kernel to validate the ring size
+    unsigned int block_timeout_ms = 10; // retire partially filled blocks after this time
+  };
+
+  struct Frame {
+    const uint8_t* data;
+    size_t size;
+    long timestamp; // microseconds since epoch
+  };
+
+  struct Stats {
+    size_t packets = 0; // seen by the socket, including dropped
+    size_t drops = 0;   // dropped by the kernel because the ring was full
+    size_t freezes = 0; // number of times the ring was completely full
+  };
+
+  PacketRing(const std::string& interface, const std::string& filter)
+      : PacketRing(interface, filter, Config {})
+  {
+  }
+
+  PacketRing(const std::string& interface, const std::string& filter, const Config& config)
+      : m_config(config)
+  {
+    m_fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (m_fd < 0) {
+      throw_error("Unable to open packet socket");
+    }
+
+    try {
+      attach_filter(filter);
+
+      int version = TPACKET_V3;
+      if (setsockopt(m_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        throw_error("TPACKET_V3 not supported");
+      }
+
+      tpacket_req3 request {};
+      request.tp_block_size = m_config.block_size;
+      request.tp_block_nr = m_config.block_count;
+      request.tp_frame_size = m_config.frame_size;
+      request.tp_frame_nr = m_config.block_size / m_config.frame_size * m_config.block_count;
+      request.tp_retire_blk_tov = m_config.block_timeout_ms;
+      if (setsockopt(m_fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) != 0) {
+        throw_error("Unable to create packet ring");
+      }
+
+      m_ring_size = static_cast<size_t>(m_config.block_size) * m_config.block_count;
+      void* map = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, 0);
+      if (map == MAP_FAILED) {
+        throw_error("Unable to map packet ring");
+      }
+      m_ring = static_cast<uint8_t*>(map);
+
+      sockaddr_ll address {};
+      address.sll_family = AF_PACKET;
+      address.sll_protocol = htons(ETH_P_ALL);
+      address.sll_ifindex = static_cast<int>(if_nametoindex(interface.c_str()));
+      if (address.sll_ifindex == 0) {
+        throw_error("Unknown interface " + interface);
+      }
+      if (bind(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        throw_error("Unable to bind to interface " + interface);
+      }
+    } catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  PacketRing(const PacketRing&) = delete;
+  PacketRing& operator=(const PacketRing&) = delete;
+
+  ~PacketRing() { release(); }
+
+  // Wait until the kernel hands over the next block, returns false on timeout
+  bool wait_block(int timeout_ms)
+  {
+    if (block_ready()) {
+      return true;
+    }
+    pollfd fd {m_fd, POLLIN | POLLERR, 0};
+    poll(&fd, 1, timeout_ms);
+    return block_ready();
+  }
+
+  // Call on_frame(const Frame&) for every UDP datagram in the current block and
+  // give the block back to the kernel. Returns the number of frames in the block.
+  template <typename Callback>
+  size_t consume_block(Callback&& on_frame)
+  {
+    if (!block_ready()) {
+      return 0;
+    }
+    auto* block = current_block();
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    const auto n_frames = block->hdr.bh1.num_pkts;
+    auto* ptr = reinterpret_cast<uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt;
+    for (unsigned int i = 0; i < n_frames; ++i) {
+      const auto* header = reinterpret_cast<const tpacket3_hdr*>(ptr);
+
+      Frame frame {};
+      if (udp_payload(ptr + header->tp_mac, header->tp_snaplen, frame.data, frame.size)) {
+        frame.timestamp = static_cast<long>(header->tp_sec) * 1000000L + static_cast<long>(header->tp_nsec / 1000U);
+        on_frame(frame);
+      }
+      ptr += header->tp_next_offset;
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    m_block = (m_block + 1) % m_config.block_count;
+    return n_frames;
+  }
+
+  // Cumulative socket statistics
+  const Stats& stats()
+  {
+    // The kernel resets its counters every time they are read
+    tpacket_stats_v3 kernel_stats {};
+    socklen_t size = sizeof(kernel_stats);
+    if (getsockopt(m_fd, SOL_PACKET, PACKET_STATISTICS, &kernel_stats, &size) == 0) {
+      m_stats.packets += kernel_stats.tp_packets;
+      m_stats.drops += kernel_stats.tp_drops;
+      m_stats.freezes += kernel_stats.tp_freeze_q_cnt;
+    }
+    return m_stats;
+  }
+
+  private:
+  tpacket_block_desc* current_block() const
+  {
+    return reinterpret_cast<tpacket_block_desc*>(m_ring + static_cast<size_t>(m_block) * m_config.block_size);
+  }
+
+  bool block_ready() const
+  {
+    const volatile auto& status = current_block()->hdr.bh1.block_status;
+    return (status & TP_STATUS_USER) != 0;
+  }
+
+  void attach_filter(const std::string& filter)
+  {
+#ifdef WITH_LIBPCAP
+    // Compile the filter with libpcap and load the resulting BPF program in the socket
+    static constexpr int snapshot_length = 65535;
+    pcap_t* handle = pcap_open_dead(DLT_EN10MB, snapshot_length);
+    bpf_program program {};
+    if (pcap_compile(handle, &program, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) != 0) {
+      std::string error = pcap_geterr(handle);
+      pcap_close(handle);
+      throw std::runtime_error("Invalid capture filter \"" + filter + "\": " + error);
+    }
+
+    sock_fprog bpf {static_cast<unsigned short>(program.bf_len), reinterpret_cast<sock_filter*>(program.bf_insns)};
+    const int status = setsockopt(m_fd, SOL_SOCKET, SO_ATTACH_FILTER, &bpf, sizeof(bpf));
+    pcap_freecode(&program);
+    pcap_close(handle);
+    if (status != 0) {
+      throw_error("Unable to attach capture filter");
+    }
+#else
+    if (!filter.empty()) {
+      throw std::runtime_error("Capture filters require libpcap");
+    }
+#endif
+  }
+
+  [[noreturn]] static void throw_error(const std::string& message)
+  {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+  }
+
+  void release()
+  {
+    if (m_ring != nullptr) {
+      munmap(m_ring, m_ring_size);
+      m_ring = nullptr;
+    }
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  Config m_config {};
+  int m_fd = -1;
+  uint8_t* m_ring = nullptr;
+  size_t m_ring_size = 0;
+  unsigned int m_block = 0;
+  Stats m_stats {};
+};
+
+// Receive UDP datagrams through a normal socket, in batches with recvmmsg
+// The datagrams are copied to preallocated buffers that are reused between batches.
+class UdpReceiver {
+  public:
+  struct Config {
+    uint16_t port = 6006;
+    int receive_buffer_size = 64 << 20; // SO_RCVBUF in bytes, limited by net.core.rmem_max without CAP_NET_ADMIN
+    unsigned int batch_size = 64;       // datagrams per recvmmsg call
+    size_t max_datagram_size = 9000;    // jumbo frames
+  };
+
+  struct Datagram {
+    const uint8_t* data;
+    size_t size;
+    long timestamp; // microseconds since epoch
+  };
+
+  struct Stats {
+    size_t drops = 0;     // dropped by the kernel because the socket buffer was full
+    size_t truncated = 0; // datagrams larger than max_datagram_size
+  };
+
+  UdpReceiver()
+      : UdpReceiver(Config {})
+  {
+  }
+
+  explicit UdpReceiver(const Config& config)
+      : m_config(config)
+  {
+    m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_fd < 0) {
+      throw_error("Unable to open UDP socket");
+    }
+
+    try {
+      int enable = 1;
+      setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+      setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable));
+      setsockopt(m_fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+
+      // Try to bypass rmem_max first, it only works with CAP_NET_ADMIN
+      int buffer_size = m_config.receive_buffer_size;
+      if (setsockopt(m_fd, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0) {
+        setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+      }
+
+      sockaddr_in address {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      address.sin_port = htons(m_config.port);
+      if (bind(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        throw_error("Unable to bind UDP port " + std::to_string(m_config.port));
+      }
+    } catch (...) {
+      close(m_fd);
+      throw;
+    }
+
+    // Preallocate the receive buffers
+    const auto batch = m_config.batch_size;
+    m_buffers.resize(batch * m_config.max_datagram_size);
+    m_control.resize(batch * control_size);
+    m_iovecs.resize(batch);
+    m_messages.resize(batch);
+    for (size_t i = 0; i < batch; ++i) {
+      m_iovecs[i].iov_base = &m_buffers[i * m_config.max_datagram_size];
+      m_iovecs[i].iov_len = m_config.max_datagram_size;
+    }
+  }
+
+  UdpReceiver(const UdpReceiver&) = delete;
+  UdpReceiver& operator=(const UdpReceiver&) = delete;
+
+  ~UdpReceiver() { close(m_fd); }
+
+  // Effective socket buffer size, the kernel reports twice the requested value
+  int receive_buffer_size() const
+  {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    getsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &size, &length);
+    return size;
+  }
+
+  // Wait until there are datagrams to read, returns false on timeout
+  bool wait(int timeout_ms) const
+  {
+    pollfd fd {m_fd, POLLIN, 0};
+    return poll(&fd, 1, timeout_ms) > 0 && (fd.revents & POLLIN) != 0;
+  }
+
+  // Read up to batch_size datagrams without blocking and call on_datagram(const Datagram&) for each one.
+  // Returns the number of datagrams received.
+  template <typename Callback>
+  size_t receive_batch(Callback&& on_datagram)
+  {
+    for (size_t i = 0; i < m_messages.size(); ++i) {
+      auto& header = m_messages[i].msg_hdr;
+      header = msghdr {};
+      header.msg_iov = &m_iovecs[i];
+      header.msg_iovlen = 1;
+      header.msg_control = &m_control[i * control_size];
+      header.msg_controllen = control_size;
+    }
+
+    const int received = recvmmsg(m_fd, m_messages.data(), static_cast<unsigned int>(m_messages.size()), MSG_DONTWAIT, nullptr);
+    if (received <= 0) {
+      return 0;
+    }
+
+    for (int i = 0; i < received; ++i) {
+      auto& header = m_messages[i].msg_hdr;
+      if ((header.msg_flags & MSG_TRUNC) != 0) {
+        ++m_stats.truncated;
+        continue;
+      }
+
+      Datagram datagram {static_cast<const uint8_t*>(m_iovecs[i].iov_base), m_messages[i].msg_len, 0};
+      for (auto* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+          continue;
+        }
+        if (cmsg->cmsg_type == SO_TIMESTAMP) {
+          timeval time {};
+          std::memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+          datagram.timestamp = static_cast<long>(time.tv_sec) * 1000000L + static_cast<long>(time.tv_usec);
+        } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+          uint32_t drops = 0; // cumulative since the socket creation
+          std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+          m_stats.drops = drops;
+        }
+      }
+      on_datagram(datagram);
+    }
+    return static_cast<size_t>(received);
+  }
+
+  const Stats& stats() const { return m_stats; }
+
+  private:
+  [[noreturn]] static void throw_error(const std::string& message)
+  {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+  }
+
+  static constexpr size_t control_size = CMSG_SPACE(sizeof(timeval)) + CMSG_SPACE(sizeof(uint32_t));
+
+  Config m_config {};
+  int m_fd = -1;
+  std::vector<uint8_t> m_buffers {};
+  std::vector<uint8_t> m_control {};
+  std::vector<iovec> m_iovecs {};
+  std::vector<mmsghdr> m_messages {};
+  Stats m_stats {};
+};
+
+#endif // __linux__
+
+} // namespace sampasrs
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <sampasrs/simd.hpp>
 #include <sampasrs/utils.hpp>
 
 #include <boost/core/bit.hpp>
@@ -13,20 +14,23 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <bitset>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <numeric>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace sampasrs {
@@ -144,26 +148,7 @@ namespace sampasrs {
     bool check_header_integrity(bool do_correction = false)
     {
       using bitmask = std::bitset<64>;
-      static constexpr uint8_t hamming_code_size = 50;
-
-      // Generate Hamming code masks
-      // see: https://en.wikipedia.org/wiki/Hamming_code#General_algorithm
-      static const auto masks = []() {
-	std::array<uint64_t, hamming_parity_bits> masks {};
-
-	for (size_t pow = 0; pow < masks.size(); ++pow) {
-	  auto base = 1U << pow;
-	  bitmask mask = 0U;
-	  for (uint8_t code_index = 1; code_index < hamming_code_size;
-	       ++code_index) {
-	    auto data_index = hamming_to_real_index(code_index);
-	    mask[data_index] = ((code_index & base) != 0);
-	  }
-	  masks[pow] = mask.to_ulong();
-	}
-
-	return masks;
-      }();
+      const auto& masks = hamming_masks();
 
       // Compute parity matrix
       uint64_t syndrome = 0;
@@ -172,9 +157,8 @@ namespace sampasrs {
 	syndrome += parity << i;
       }
 
-      static constexpr uint64_t overall_parity_mask = ((uint64_t {1} << 52U) - 1) ^ (uint64_t(0b11) << 30U);
       // The parity will always be even when we include the parity bit
-      const auto overall_parity = odd_parity(data & overall_parity_mask);
+      const auto overall_parity = odd_parity(data & parity_mask);
 
       if (!do_correction) {
 	return overall_parity == 0 && syndrome == 0;
@@ -202,14 +186,14 @@ namespace sampasrs {
     // return odd parity of data hit
     uint8_t compute_data_parity(uint8_t words = 5) const
     {
-      static const uint64_t mask = []() {
-	uint64_t mask = (uint64_t {1} << 52U) - 1;
-	// Ignore full and non set bits
-	mask ^= uint64_t {0b11} << 30U;
-	return mask;
-      }();
+      return odd_parity(data_parity_bits(words));
+    }
 
-      uint64_t masked_data = data & mask;
+    // Bits covered by the data parity, the parity is linear so the bits of
+    // many hits can be XORed together and the parity computed only once
+    uint64_t data_parity_bits(uint8_t words = 5) const
+    {
+      uint64_t masked_data = data & parity_mask;
 
       // FIXME: will this work with TRIGTOOEARLY hits?
       // Ignore padding words at the end of the data stream
@@ -222,7 +206,7 @@ namespace sampasrs {
 	masked_data &= mask;
       }
 
-      return odd_parity(masked_data);
+      return masked_data;
     }
 
     std::string to_string() const
@@ -244,68 +228,151 @@ namespace sampasrs {
     static constexpr uint8_t words_per_hit = 5;
     static constexpr uint8_t bits_per_word = 10;
     static constexpr uint8_t hamming_parity_bits = 6;
+    static constexpr uint8_t hamming_code_size = 50;
+    // Every header and data bit, except the full flag and the unused bit
+    static constexpr uint64_t parity_mask = ((uint64_t {1} << 52U) - 1) ^ (uint64_t {0b11} << 30U);
+
+    // Header bits covered by each Hamming parity bit
+    // see: https://en.wikipedia.org/wiki/Hamming_code#General_algorithm
+    static const std::array<uint64_t, hamming_parity_bits>& hamming_masks()
+    {
+      static const auto masks = []() {
+	std::array<uint64_t, hamming_parity_bits> masks {};
+
+	for (size_t pow = 0; pow < masks.size(); ++pow) {
+	  auto base = 1U << pow;
+	  std::bitset<64> mask = 0U;
+	  for (uint8_t code_index = 1; code_index < hamming_code_size;
+	       ++code_index) {
+	    auto data_index = hamming_to_real_index(code_index);
+	    mask[data_index] = ((code_index & base) != 0);
+	  }
+	  masks[pow] = mask.to_ulong();
+	}
+
+	return masks;
+      }();
+      return masks;
+    }
+
+    // Computes the Hamming syndrome in the bits 0 to 5 and the parity of parity_mask in the bit 6,
+    // for many hits at once, see ParityMatrix
+    static const ParityMatrix& parity_matrix()
+    {
+      static const ParityMatrix matrix = []() {
+	const auto& masks = hamming_masks();
+	return ParityMatrix({masks[0], masks[1], masks[2], masks[3], masks[4], masks[5], parity_mask, 0});
+      }();
+      return matrix;
+    }
+
+    // Same result of check_header_integrity() without correction
+    static bool header_parity_ok(uint8_t parity) { return (parity & 0x7fU) == 0; }
+
     uint64_t data;
   };
 
-  template <typename T>
-  void deserialize(std::ifstream& file, T& out)
+  // Bytes owned by someone else, e.g. a mapped file, with the part of the std::vector interface the decoder uses
+  class ByteView {
+  public:
+    ByteView() = default;
+    ByteView(const uint8_t* data, size_t size)
+      : m_data(data)
+      , m_size(size)
+    {
+    }
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const uint8_t* begin() const { return m_data; }
+    const uint8_t* end() const { return m_data + m_size; }
+    const uint8_t& operator[](size_t i) const { return m_data[i]; } // NOLINT
+
+  private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+  };
+
+  // Serialized records in memory, read like an std::ifstream without copying them to a stream buffer first
+  class MemoryInput {
+  public:
+    MemoryInput(const uint8_t* begin, size_t size)
+      : m_position(begin)
+      , m_end(begin + size)
+    {
+    }
+
+    // Fails, like a stream, when less than size bytes are left
+    MemoryInput& read(char* out, std::streamsize size)
+    {
+      const auto bytes = view(static_cast<size_t>(size));
+      if (!m_failed) {
+	std::memcpy(out, bytes.data(), bytes.size());
+      }
+      return *this;
+    }
+
+    // The next size bytes, in place
+    ByteView view(size_t size)
+    {
+      if (m_failed || static_cast<size_t>(m_end - m_position) < size) {
+	m_failed = true;
+	m_position = m_end;
+	return {};
+      }
+      const ByteView bytes(m_position, size);
+      m_position += size;
+      return bytes;
+    }
+
+    explicit operator bool() const { return !m_failed; }
+    bool eof() const { return m_position == m_end; }
+    size_t remaining() const { return static_cast<size_t>(m_end - m_position); }
+
+  private:
+    const uint8_t* m_position;
+    const uint8_t* m_end;
+    bool m_failed = false;
+  };
+
+  // Input is an std::ifstream or anything with the same read, e.g. a MemoryInput
+  template <typename Input, typename T>
+  void deserialize(Input& file, T& out)
   {
     file.read(reinterpret_cast<char*>(&out), sizeof(out));
   }
 
-  template <typename T>
-  void deserialize(std::ifstream& file, std::vector<T>& out)
+  template <typename Input, typename T>
+  void deserialize(Input& file, std::vector<T>& out)
   {
     unsigned int size {};
     deserialize(file, size);
+    if (!file) {
+      out.clear();
+      return;
+    }
     out.resize(size);
     file.read(reinterpret_cast<char*>(out.data()), out.size() * sizeof(T));
   }
 
-  template <typename T>
-  void serialize(std::ofstream& file, T input)
+  // Output is an std::ofstream or anything with the same write, e.g. a BlockWriter
+  template <typename Output, typename T>
+  void serialize(Output& file, T input)
   {
     file.write(reinterpret_cast<const char*>(&input), sizeof(input));
   }
 
-  template <typename T>
-  void serialize(std::ofstream& file, const std::vector<T>& input)
+  template <typename Output, typename T>
+  void serialize(Output& file, const std::vector<T>& input)
   {
     serialize(file, static_cast<unsigned int>(input.size()));
     file.write(reinterpret_cast<const char*>(input.data()), input.size() * sizeof(T));
   }
 
-  struct Payload {
-    Payload() = default;
-
-    explicit Payload(payload_data&& _data, long _timestamp = 0)
-      : timestamp(_timestamp)
-      , data(std::move(_data))
-    {
-    }
-
-#ifdef WITH_LIBPCAP
-    explicit Payload(Tins::Packet&& packet)
-      : timestamp(std::chrono::microseconds(packet.timestamp()).count())
-      , data(std::move(packet.pdu()->rfind_pdu<Tins::RawPDU>().payload()))
-    {
-    }
-#endif
-
-    static Payload read(std::ifstream& file)
-    {
-      Payload payload {};
-      deserialize(file, payload.timestamp);
-      deserialize(file, payload.data);
-      return payload;
-    }
-
-    void write(std::ofstream& file) const
-    {
-      serialize(file, timestamp);
-      serialize(file, data);
-    }
-
+  // Header accessors shared by the payloads owning their data and the views of payloads stored elsewhere
+  template <typename Data>
+  struct BasicPayload {
     uint32_t frame_counter() const
     {
       return read_from_buffer<uint32_t>(&data[header_offset]); // NOLINT
@@ -345,11 +412,60 @@ namespace sampasrs {
     static constexpr size_t header_size = 16;
 
     long timestamp = 0;
-    payload_data data;
+    Data data {};
     size_t header_offset = 0;
     size_t hit_offset = header_size;
   };
 
+  struct Payload : BasicPayload<payload_data> {
+    Payload() = default;
+
+    explicit Payload(payload_data&& _data, long _timestamp = 0)
+    {
+      timestamp = _timestamp;
+      data = std::move(_data);
+    }
+
+#ifdef WITH_LIBPCAP
+    explicit Payload(Tins::Packet&& packet)
+    {
+      timestamp = std::chrono::microseconds(packet.timestamp()).count();
+      data = std::move(packet.pdu()->rfind_pdu<Tins::RawPDU>().payload());
+    }
+#endif
+
+    template <typename Input>
+    static Payload read(Input& file)
+    {
+      Payload payload {};
+      deserialize(file, payload.timestamp);
+      deserialize(file, payload.data);
+      return payload;
+    }
+
+    template <typename Output>
+    void write(Output& file) const
+    {
+      serialize(file, timestamp);
+      serialize(file, data);
+    }
+  };
+
+  // Payload read in place from a .raw file in memory, valid while the memory is
+  // The assemblers take it like a Payload, without copying the hits
+  struct PayloadView : BasicPayload<ByteView> {
+    // Check the input afterwards, a truncated record leaves it failed
+    static PayloadView read(MemoryInput& input)
+    {
+      PayloadView payload {};
+      unsigned int size = 0;
+      deserialize(input, payload.timestamp);
+      deserialize(input, size);
+      payload.data = input.view(size);
+      return payload;
+    }
+  };
+
   struct Event {
     std::vector<Hit> hits {};
     std::vector<size_t> waveform_begin {};
@@ -359,13 +475,23 @@ namespace sampasrs {
     std::bitset<8> error = 0;
     short open_queues = 0; // Number of channels receiving data
 
+    // Waveforms sent by each FEC, only in events built from several FECs
+    // They are not stored in the .rawev files
+    struct Fragment {
+      uint8_t fec_id = 0;
+      size_t first_waveform = 0;
+      size_t waveform_count = 0;
+    };
+    std::vector<Fragment> fragments {};
+
     enum Err : unsigned char {
       DataCorrupt,
       HeaderCorrupt,
       MissingHeader,
       MissingData,
       FullQueue,
-      MissingPayload
+      MissingPayload,
+      MissingFragment // built without the data of some FECs
     };
 
     bool valid() const { return error.none(); }
@@ -378,6 +504,17 @@ namespace sampasrs {
 
     size_t waveform_count() const { return waveform_begin.size(); }
 
+    // FEC that sent the waveform
+    uint8_t waveform_fec_id(size_t waveform) const
+    {
+      for (const auto& fragment : fragments) {
+	if (waveform - fragment.first_waveform < fragment.waveform_count) {
+	  return fragment.fec_id;
+	}
+      }
+      return fec_id;
+    }
+
     size_t word_count(size_t waveform) const
     {
       return get_header(waveform).word_count();
@@ -390,15 +527,42 @@ namespace sampasrs {
       return hits[hit_idx].word(word_idx);
     }
 
-    std::vector<short> copy_waveform(size_t waveform) const
+    // Decode all the words of a waveform at once, samples must hold word_count(waveform) values
+    // Returns the number of words written
+    size_t unpack_waveform(size_t waveform, int16_t* samples) const
     {
-      std::vector<short> data;
-      auto words = word_count(waveform);
-      data.resize(words);
+      static_assert(sizeof(Hit) == sizeof(uint64_t), "Hits must be stored as plain 64 bit words");
+      const auto words = word_count(waveform);
+      const auto* data = reinterpret_cast<const uint64_t*>(hits.data() + waveform_begin[waveform] + 1);
+      unpack_samples(data, words, samples);
+      return words;
+    }
 
-      for (size_t i = 0; i < words; ++i) {
-	data[i] = get_word(waveform, i);
+    // Number of words of all waveforms
+    size_t total_word_count() const
+    {
+      size_t words = 0;
+      for (size_t waveform = 0; waveform < waveform_count(); ++waveform) {
+	words += word_count(waveform);
       }
+      return words;
+    }
+
+    // Decode all waveforms one after the other, samples must hold total_word_count() values
+    // Returns the number of words written
+    size_t unpack(int16_t* samples) const
+    {
+      size_t words = 0;
+      for (size_t waveform = 0; waveform < waveform_count(); ++waveform) {
+	words += unpack_waveform(waveform, samples + words);
+      }
+      return words;
+    }
+
+    std::vector<short> copy_waveform(size_t waveform) const
+    {
+      std::vector<short> data(word_count(waveform));
+      unpack_waveform(waveform, data.data());
       return data;
     }
 
@@ -409,19 +573,30 @@ namespace sampasrs {
       return waveform_begin.back();
     }
 
-    static Event read(std::ifstream& file)
+    template <typename Input>
+    static Event read(Input& file)
     {
       Event event {};
+      read(file, event);
+      return event;
+    }
+
+    // Read into an existing event, reusing its memory
+    template <typename Input>
+    static void read(Input& file, Event& event)
+    {
       deserialize(file, event.hits);
       deserialize(file, event.waveform_begin);
       deserialize(file, event.timestamp);
       deserialize(file, event.bx_count);
       deserialize(file, event.fec_id);
       deserialize(file, event.error);
-      return event;
+      event.open_queues = 0;
+      event.fragments.clear();
     }
 
-    void write(std::ofstream& file) const
+    template <typename Output>
+    void write(Output& file) const
     {
       serialize(file, hits);
       serialize(file, waveform_begin);
@@ -435,16 +610,340 @@ namespace sampasrs {
     {
       return hits.size() * sizeof(Hit);
     }
+
+    // Allocated bytes, including the reserved memory
+    size_t memory_use() const
+    {
+      return hits.capacity() * sizeof(Hit) + waveform_begin.capacity() * sizeof(size_t);
+    }
+
+    // Reset to an empty event keeping the allocated memory
+    void clear()
+    {
+      hits.clear();
+      waveform_begin.clear();
+      timestamp = 0;
+      bx_count = 0;
+      fec_id = 0;
+      error.reset();
+      open_queues = 0;
+      fragments.clear();
+    }
+  };
+
+  // Decoded event stored column by column: one entry per waveform in each column and all the samples in one buffer
+  // The samples of waveform i are samples[sample_offset[i]] to samples[sample_offset[i] + sample_count[i] - 1]
+  struct ColumnarEvent {
+    long timestamp = 0;
+    uint32_t bx_count = 0;
+    uint8_t fec_id = 0;
+    std::bitset<8> error = 0;
+
+    std::vector<uint8_t> fec {};            // FEC that sent the waveform
+    std::vector<int16_t> channel {};        // global channel, 32 * sampa + channel
+    std::vector<uint16_t> sample_count {};
+    std::vector<uint32_t> sample_offset {};
+    std::vector<int16_t> samples {};
+
+    bool valid() const { return error.none(); }
+
+    size_t waveform_count() const { return channel.size(); }
+
+    const int16_t* waveform(size_t waveform) const { return samples.data() + sample_offset[waveform]; }
+
+    // Decode an event, reusing the memory of the columns
+    // Each header is read once and its samples decoded right away, into room for all the hits of the event
+    void assign(const Event& event)
+    {
+      timestamp = event.timestamp;
+      bx_count = event.bx_count;
+      fec_id = event.fec_id;
+      error = event.error;
+
+      const auto waveforms = event.waveform_count();
+      channel.resize(waveforms);
+      sample_count.resize(waveforms);
+      sample_offset.resize(waveforms);
+      samples.resize(event.hits.size() * Hit::words_per_hit);
+
+      // The waveforms of a FEC are consecutive, built events have one fragment per FEC
+      fec.assign(waveforms, event.fec_id);
+      for (const auto& fragment : event.fragments) {
+	std::fill_n(fec.begin() + static_cast<long>(fragment.first_waveform), fragment.waveform_count, fragment.fec_id);
+      }
+
+      static_assert(sizeof(Hit) == sizeof(uint64_t), "Hits must be stored as plain 64 bit words");
+      const auto* hits = reinterpret_cast<const uint64_t*>(event.hits.data());
+      uint32_t words = 0;
+      for (size_t i = 0; i < waveforms; ++i) {
+	const auto begin = event.waveform_begin[i];
+	const auto header = event.hits[begin];
+	const auto count = static_cast<uint16_t>(header.word_count());
+	channel[i] = static_cast<int16_t>(header.global_channel());
+	sample_count[i] = count;
+	sample_offset[i] = words;
+	if (words + count > samples.size()) {
+	  samples.resize(words + count); // a header counting more words than its hits, e.g. from a corrupted file
+	}
+	unpack_samples(hits + begin + 1, count, samples.data() + words);
+	words += count;
+      }
+      samples.resize(words);
+    }
+
+    // Allocated bytes, including the reserved memory
+    size_t memory_use() const
+    {
+      return fec.capacity() * sizeof(uint8_t) + channel.capacity() * sizeof(int16_t)
+	+ sample_count.capacity() * sizeof(uint16_t) + sample_offset.capacity() * sizeof(uint32_t)
+	+ samples.capacity() * sizeof(int16_t);
+    }
+
+    // Reset to an empty event keeping the allocated memory
+    void clear()
+    {
+      timestamp = 0;
+      bx_count = 0;
+      fec_id = 0;
+      error.reset();
+      fec.clear();
+      channel.clear();
+      sample_count.clear();
+      sample_offset.clear();
+      samples.clear();
+    }
+  };
+
+  // 64 bit FNV-1a of a decoder state, equal hashes mean equal states
+  class StateHash {
+  public:
+    template <typename T>
+    void add(const T& value)
+    {
+      static_assert(std::is_trivially_copyable<T>::value, "Hash the members of structures, not their padding");
+      add_bytes(&value, sizeof(value));
+    }
+
+    template <typename T>
+    void add(const std::vector<T>& values)
+    {
+      add(values.size());
+      add_bytes(values.data(), values.size() * sizeof(T));
+    }
+
+    uint64_t value() const { return m_value; }
+
+  private:
+    void add_bytes(const void* data, size_t size)
+    {
+      const auto* bytes = static_cast<const uint8_t*>(data);
+      for (size_t i = 0; i < size; ++i) {
+	m_value = (m_value ^ bytes[i]) * 0x100000001b3U;
+      }
+    }
+
+    uint64_t m_value = 0xcbf29ce484222325U;
+  };
+
+  // Fixed capacity open addressing table of the events being assembled, keyed by bx_count
+  // Events never move, pointers to them stay valid until they are erased
+  template <size_t Capacity>
+  class EventTable {
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    EventTable() { m_keys.fill(empty_key); }
+
+    // Event with this bx_count, nullptr if there is none
+    Event* find(uint32_t bx_count)
+    {
+      auto slot = home(bx_count);
+      for (size_t probe = 0; probe <= m_max_probe; ++probe, slot = next(slot)) {
+	if (m_keys[slot] == bx_count) {
+	  return &m_events[slot];
+	}
+      }
+      return nullptr;
+    }
+
+    // Store a new empty event, nullptr if the table is full
+    Event* insert(uint32_t bx_count)
+    {
+      auto slot = home(bx_count);
+      for (size_t probe = 0; probe < Capacity; ++probe, slot = next(slot)) {
+	if (m_keys[slot] == empty_key) {
+	  m_keys[slot] = bx_count;
+	  m_max_probe = std::max(m_max_probe, probe);
+	  ++m_size;
+
+	  auto& event = m_events[slot];
+	  event.bx_count = bx_count;
+	  return &event;
+	}
+      }
+      return nullptr;
+    }
+
+    // The event must belong to this table, its storage is kept for the next insert
+    void erase(const Event& event)
+    {
+      const auto slot = this->slot(event);
+      m_keys[slot] = empty_key;
+      m_events[slot].clear();
+      if (--m_size == 0) {
+	m_max_probe = 0;
+      }
+    }
+
+    // Event stored where bx_count would go first
+    Event& home_event(uint32_t bx_count) { return m_events[home(bx_count)]; }
+
+    // Call function(event) for each stored event, the function may erase it
+    template <typename Function>
+    void for_each(Function&& function)
+    {
+      for (size_t slot = 0; slot < Capacity && m_size != 0; ++slot) {
+	if (m_keys[slot] != empty_key) {
+	  function(m_events[slot]);
+	}
+      }
+    }
+
+    template <typename Function>
+    void for_each(Function&& function) const
+    {
+      for (size_t slot = 0; slot < Capacity && m_size != 0; ++slot) {
+	if (m_keys[slot] != empty_key) {
+	  function(m_events[slot]);
+	}
+      }
+    }
+
+    // Where the event is stored, it must belong to this table
+    size_t slot(const Event& event) const { return static_cast<size_t>(&event - m_events.data()); }
+
+    void clear()
+    {
+      for_each([this](Event& event) { erase(event); });
+    }
+
+    size_t size() const { return m_size; }
+    static constexpr size_t capacity() { return Capacity; }
+
+    // Bytes allocated by all slots, erased events keep their memory
+    size_t memory_use() const
+    {
+      size_t bytes = 0;
+      for (const auto& event : m_events) {
+	bytes += event.memory_use();
+      }
+      return bytes;
+    }
+
+  private:
+    static size_t home(uint32_t bx_count) { return bx_count & (Capacity - 1); }
+    static size_t next(size_t slot) { return (slot + 1) & (Capacity - 1); }
+
+    static constexpr uint32_t empty_key = std::numeric_limits<uint32_t>::max(); // bx_count has only 20 bits
+
+    std::array<Event, Capacity> m_events {};
+    std::array<uint32_t, Capacity> m_keys {};
+    size_t m_size = 0;
+    size_t m_max_probe = 0; // largest distance of a stored event from its home slot
   };
 
-  class EventAssembler {
+  // Keeps the memory of processed events, so new events don't grow their vectors from scratch
+  // Events can be released from any thread
+  class EventPool {
   public:
-    explicit EventAssembler(const std::function<void(Event&&)>& event_handler)
-      : m_event_handler(event_handler)
+    explicit EventPool(size_t max_events = default_max_events)
+      : m_max_events(max_events)
+    {
+    }
+
+    // Empty event, with the memory of a released one if there is any
+    Event acquire()
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_events.empty()) {
+	m_misses.fetch_add(1, std::memory_order_relaxed);
+	return Event {};
+      }
+      m_hits.fetch_add(1, std::memory_order_relaxed);
+      auto event = std::move(m_events.back());
+      m_events.pop_back();
+      return event;
+    }
+
+    void release(Event&& event)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      recycle(std::move(event));
+    }
+
+    void release(std::vector<Event>& events)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto& event : events) {
+	recycle(std::move(event));
+      }
+    }
+
+    size_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+    size_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+
+    // Bytes held by the released events
+    size_t memory_use()
     {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      size_t bytes = 0;
+      for (const auto& event : m_events) {
+	bytes += event.memory_use();
+      }
+      return bytes;
+    }
+
+    // Percentage of acquired events that reused memory
+    float hit_rate() const
+    {
+      const auto total = hits() + misses();
+      return total == 0 ? 0.f : static_cast<float>(hits()) / static_cast<float>(total) * 100.f;
     }
 
-    void process(Payload& payload)
+    static constexpr size_t default_max_events = 128; // full events can take hundreds of kB each
+
+  private:
+    void recycle(Event&& event)
+    {
+      // Moved from events have nothing to give back
+      if (event.hits.capacity() == 0 || m_events.size() >= m_max_events) {
+	return;
+      }
+      event.clear();
+      m_events.push_back(std::move(event));
+    }
+
+    std::mutex m_mutex {};
+    std::vector<Event> m_events {};
+    size_t m_max_events;
+    std::atomic<size_t> m_hits {0};
+    std::atomic<size_t> m_misses {0};
+  };
+
+  // Sorts the hits of a FEC data stream into events, passed to the event handler once complete
+  // With a lambda as handler, the call is inlined in the decoding loop
+  // A handler taking a const ColumnarEvent& gets the events already decoded, in a buffer reused for every event
+  template <typename Handler>
+  class BasicEventAssembler {
+  public:
+    explicit BasicEventAssembler(Handler event_handler)
+      : m_event_handler(std::move(event_handler))
+    {
+    }
+
+    // Payload or PayloadView, only the header and hit offsets are changed
+    template <typename Data>
+    void process(BasicPayload<Data>& payload)
     {
       ++m_processed_payloads;
 
@@ -462,21 +961,85 @@ namespace sampasrs {
 	return;
       }
 
-      for (size_t i = 0; i < payload.n_hits(); ++i) {
-	auto hit = payload.hit(i);
-	process(hit, payload.fec_id(), payload.timestamp);
+      const auto& parity_matrix = Hit::parity_matrix();
+      const auto n_hits = payload.n_hits();
+      const auto fec_id = payload.fec_id();
+      const auto* hits = payload.data.data() + payload.hit_offset;
+      m_payload_headers = 0;
+
+      if (ParityMatrix::vectorized && m_header_dense) {
+	// Check the parity of a block of hits at once, while they are in cache
+	std::array<uint8_t, 256> parity;
+	for (size_t block = 0; block < n_hits; block += parity.size()) {
+	  const auto block_hits = std::min(parity.size(), n_hits - block);
+	  parity_matrix.compute(hits + block * sizeof(Hit), block_hits, parity.data());
+
+	  for (size_t i = 0; i < block_hits; ++i) {
+	    process(Hit(hits + (block + i) * sizeof(Hit)), fec_id, payload.timestamp, parity[i]);
+	  }
+	}
+      } else {
+	for (size_t i = 0; i < n_hits; ++i) {
+	  const Hit hit(hits + i * sizeof(Hit));
+	  // Only the headers use the parity
+	  process(hit, fec_id, payload.timestamp, hit.pk() == Hit::HEADER ? parity_matrix(hit.data) : 0);
+	}
       }
+
+      // Checking every hit only pays off for short waveforms, when many hits are headers
+      m_header_dense = m_payload_headers * 4 > n_hits;
+
+      evict_old_events(payload.timestamp);
     }
 
     void clear()
     {
-      m_event_pool.clear();
+      m_events.clear();
       std::fill(m_queues.begin(), m_queues.end(), Queue {});
       m_processed_events = 0;
       m_processed_payloads = 0;
+      m_evicted_events = 0;
     }
 
     size_t get_processed_events() const { return m_processed_events; }
+    // Incomplete events flushed with MissingPayload, because they were too old or had no space left
+    size_t get_evicted_events() const { return m_evicted_events; }
+    // Bytes allocated by the events being assembled
+    size_t memory_use() const { return m_events.memory_use() + m_columnar_event.memory_use(); }
+
+    // Hash of everything that decides the next events, two assemblers with the same digest give the same events
+    // for the same payloads, e.g. one started on a later file of the run and one that decoded the run from the start
+    uint64_t state_digest() const
+    {
+      StateHash hash {};
+      m_events.for_each([&](const Event& event) {
+	hash.add(m_events.slot(event));
+	hash.add(event.hits);
+	hash.add(event.waveform_begin);
+	hash.add(event.timestamp);
+	hash.add(event.bx_count);
+	hash.add(event.fec_id);
+	hash.add(event.error.to_ulong());
+	hash.add(event.open_queues);
+      });
+      hash.add(std::numeric_limits<size_t>::max()); // end of the events
+      for (const auto& queue : m_queues) {
+	hash.add(queue.event == nullptr ? std::numeric_limits<size_t>::max() : m_events.slot(*queue.event));
+	hash.add(queue.remaining_hits);
+	hash.add(queue.next_index);
+	hash.add(queue.is_open);
+	hash.add(queue.data_bits);
+	hash.add(queue.expected_data_parity);
+	hash.add(queue.words_in_last_hit);
+      }
+      hash.add(m_alignment);
+      if (m_alignment != 0) {
+	hash.add(m_leftover);
+      }
+      hash.add(m_last_bx_count);
+      hash.add(std::min<size_t>(m_processed_events, 4)); // the first events are dropped
+      return hash.value();
+    }
 
   private:
     struct Queue {
@@ -484,14 +1047,15 @@ namespace sampasrs {
       short remaining_hits = 0;    // Expected number of hits until the end of the queue
       unsigned int next_index = 0; // where to store new queue data in the event
       bool is_open = false;
-      uint8_t data_parity = 0;
+      uint64_t data_bits = 0; // XOR of the stored hits data_parity_bits()
       uint8_t expected_data_parity {};
       int words_in_last_hit {};
 
       void clear() { *this = Queue {}; }
     };
 
-    void process(Hit hit, uint8_t fec_id, long timestamp)
+    // parity is the hit result of Hit::parity_matrix()
+    void process(Hit hit, uint8_t fec_id, long timestamp, uint8_t parity)
     {
       auto queue_id = hit.queue_index();
       if (queue_id >= queue_size) {
@@ -501,28 +1065,36 @@ namespace sampasrs {
 
       switch (hit.pk()) {
       case Hit::HEADER: {
-	if (!hit.check_header_integrity(enable_header_fix)) {
+	++m_payload_headers;
+	if (!Hit::header_parity_ok(parity) && !(enable_header_fix && hit.check_header_integrity(true))) {
 	  break;
 	}
 	auto bx_count = hit.bx_count();
-	auto& event = m_event_pool[hit.bx_count()];
+	m_last_bx_count = bx_count;
+	auto* event = m_events.find(bx_count);
 
 	// New event
-	if (event.hits.empty()) {
-	  event.bx_count = bx_count;
-	  event.fec_id = fec_id;
-	  event.timestamp = timestamp;
+	if (event == nullptr) {
+	  event = m_events.insert(bx_count);
+	  if (event == nullptr) {
+	    // No space left, the event in the way is never going to be completed
+	    flush(m_events.home_event(bx_count));
+	    event = m_events.insert(bx_count);
+	  }
+	  event->fec_id = fec_id;
+	  event->timestamp = timestamp;
+	  reuse_memory(*event);
 	}
 
-	open_queue(queue, hit, event);
+	open_queue(queue, hit, *event);
       } break;
 
       case Hit::DATA: {
-	store_hit(queue, hit);
+	store_hit(queue, hit, hit.data); // masked by close_queue
       } break;
 
       case Hit::END: {
-	store_hit(queue, hit);
+	store_hit(queue, hit, hit.data_parity_bits(queue.words_in_last_hit));
 	if (queue.remaining_hits != 0) {
 	  queue.event->set_error(Event::Err::MissingData);
 	}
@@ -530,7 +1102,7 @@ namespace sampasrs {
       } break;
 
       case Hit::TRIGTOOEARLY: {
-	store_hit(queue, hit);
+	store_hit(queue, hit, hit.data_parity_bits(queue.words_in_last_hit));
 	close_queue(queue);
       } break;
       }
@@ -557,17 +1129,18 @@ namespace sampasrs {
       queue.remaining_hits = hit.hit_count();
       queue.next_index = new_event.add_waveform(queue.remaining_hits);
       queue.is_open = true;
-      queue.data_parity = 0;
+      queue.data_bits = 0;
       queue.expected_data_parity = hit.data_parity();
       queue.words_in_last_hit = hit.word_count() % Hit::words_per_hit;
       if (queue.words_in_last_hit == 0) {
 	queue.words_in_last_hit = Hit::words_per_hit;
       }
 
-      store_hit(queue, hit);
+      store_hit(queue, hit, 0);
     }
 
-    static void store_hit(Queue& queue, Hit hit)
+    // data_bits are the bits of the hit covered by the queue data parity, zero for headers
+    static void store_hit(Queue& queue, Hit hit, uint64_t data_bits)
     {
       // We missed the queue header, we will ignore this hit
       if (!queue.is_open) {
@@ -590,22 +1163,14 @@ namespace sampasrs {
       ++queue.next_index;
       --queue.remaining_hits;
 
-      // Compute data parity
-      switch (hit.pk()) {
-      case Hit::DATA:
-	queue.data_parity ^= hit.compute_data_parity();
-	break;
-      case Hit::END:
-      case Hit::TRIGTOOEARLY:
-	queue.data_parity ^= hit.compute_data_parity(queue.words_in_last_hit);
-	break;
-      }
+      queue.data_bits ^= data_bits;
     }
 
     static void close_queue(Queue& queue)
     {
       // Check data parity
-      if (queue.event != nullptr && (queue.data_parity != queue.expected_data_parity)) {
+      const auto data_parity = odd_parity(queue.data_bits & Hit::parity_mask);
+      if (queue.event != nullptr && (data_parity != queue.expected_data_parity)) {
 	queue.event->set_error(Event::DataCorrupt);
       }
       queue.is_open = false;
@@ -613,19 +1178,83 @@ namespace sampasrs {
 
     void process(Event& event)
     {
-      auto bx_count = event.bx_count;
       // Ignore initial and incomplete events
       if ((event.valid() || process_invalid_events) && m_processed_events > 3) {
 	// Process event
-	m_event_handler(std::move(event));
+	if constexpr (std::is_invocable_v<Handler&, Event&&>) {
+	  m_event_handler(std::move(event));
+	} else {
+	  // Columnar handler, the same buffer is decoded into for every event
+	  m_columnar_event.assign(event);
+	  m_event_handler(std::as_const(m_columnar_event));
+	}
       }
       // Remove event from pool
-      m_event_pool.erase(bx_count);
+      m_events.erase(event);
 
       ++m_processed_events;
     }
 
-    void remove_caca(Payload& payload)
+    // The handler may have moved the previous event of this slot away, take the memory of a released one
+    void reuse_memory(Event& event)
+    {
+      if (event_pool == nullptr || event.hits.capacity() != 0) {
+	return;
+      }
+      auto recycled = event_pool->acquire();
+      event.hits = std::move(recycled.hits);
+      event.waveform_begin = std::move(recycled.waveform_begin);
+    }
+
+    // Process an event before all its queues are closed
+    void flush(Event& event)
+    {
+      ++m_evicted_events;
+      event.set_error(Event::MissingPayload);
+      detach(event);
+      process(event);
+    }
+
+    // Forget the queues of an event, so their next headers don't process it again
+    void detach(const Event& event)
+    {
+      for (auto& queue : m_queues) {
+	if (queue.event == &event) {
+	  queue.clear();
+	}
+      }
+    }
+
+    // Finish the events left behind by the acquisition, e.g. when a queue never reopens
+    void evict_old_events(long timestamp)
+    {
+      if (max_bx_distance == 0 && max_event_age.count() == 0) {
+	return;
+      }
+
+      m_events.for_each([&](Event& event) {
+	// Events newer than the last header wrap around to large distances
+	const auto bx_distance = (m_last_bx_count - event.bx_count) & (bx_count_range - 1);
+	const bool too_far = max_bx_distance != 0 && bx_distance > max_bx_distance && bx_distance < bx_count_range / 2;
+	const bool too_old = max_event_age.count() != 0 && timestamp - event.timestamp > max_event_age.count();
+	if (!too_far && !too_old) {
+	  return;
+	}
+
+	// An event with all its queues closed only waits for their next headers, it isn't missing anything
+	const bool complete = std::none_of(m_queues.begin(), m_queues.end(),
+					   [&](const Queue& queue) { return queue.event == &event && queue.is_open; });
+	if (complete) {
+	  detach(event);
+	  process(event);
+	} else {
+	  flush(event);
+	}
+      });
+    }
+
+    template <typename Data>
+    void remove_caca(BasicPayload<Data>& payload)
     {
       auto& data = payload.data;
       long header_offset = static_cast<long>(payload.header_offset);
@@ -641,9 +1270,7 @@ namespace sampasrs {
 	}
 
 	// Damn! the data is misaligned
-	auto first_valid = std::find_if(data.begin(), data.end(),
-					[](auto x) { return x != 0xcaU; });
-	header_offset = first_valid - data.begin();
+	header_offset = static_cast<long>(find_first_not(data.data(), data.size(), 0xca));
 	hit_offset = header_offset + static_cast<long>(Payload::header_size);
       }
 
@@ -660,21 +1287,19 @@ namespace sampasrs {
       }
 
       // Then we check if the alignment didn't change
+      // All the candidate alignments are checked in one pass over the payload
+      const auto alignments = valid_alignments(data.data() + hit_offset, data.size() - hit_offset);
 
       unsigned char new_alignment = 0;
       // first we test if the previous alignment is still valid
-      if (check_alignment(data.begin() + hit_offset + m_alignment, data.end())) {
+      if ((alignments & (1U << m_alignment)) != 0) {
 	new_alignment = m_alignment;
       } else {
 	// The alignment changed!
-	for (auto index = data.begin() + hit_offset;
-	     !check_alignment(index, data.end()) && new_alignment < sizeof(Hit);
-	     ++new_alignment, ++index) {
-	}
-
-	if (new_alignment == 8) {
+	if (alignments == 0) {
 	  throw std::runtime_error("DEU RUIM NO ALINHAMENTO");
 	}
+	new_alignment = static_cast<unsigned char>(boost::core::countr_zero(alignments));
       }
 
       int stored_leftover = static_cast<int>(sizeof(Hit)) - new_alignment;
@@ -684,7 +1309,8 @@ namespace sampasrs {
 	  std::copy(data.begin() + hit_offset,
 		    data.begin() + hit_offset + new_alignment,
 		    m_leftover.begin() + stored_leftover);
-	  process(Hit(m_leftover.data()), payload.fec_id(), payload.timestamp);
+	  const Hit hit(m_leftover.data());
+	  process(hit, payload.fec_id(), payload.timestamp, Hit::parity_matrix()(hit.data));
 	}
 
 	std::copy(data.end() - stored_leftover, data.end(), m_leftover.begin());
@@ -694,38 +1320,112 @@ namespace sampasrs {
       payload.hit_offset = hit_offset + new_alignment;
     }
 
-    // check if the alignment is correct using the constant bits
-    static bool check_alignment(payload_data::iterator begin,
-				payload_data::iterator end)
-    {
-      const auto n_hits = (end - begin) / sizeof(Hit);
-
-      bool alignment_found = true;
-      for (int i = 0; alignment_found && i < n_hits; ++i, begin += sizeof(Hit)) {
-	// TODO: we should improve the tested bits
-	// pk11110q qqqq...
-	alignment_found = (*begin & 0b00000010U) == 0 && (*(begin + 4) & 0b01000000U) == 0;
-      }
-      return alignment_found;
-    }
-
   public:
     static constexpr uint32_t expected_data_id = 0x564d33U; // VM3
     bool process_invalid_events = false;                    // The events marked invalid will also be passed to the event_handler
     bool enable_remove_caca = true;                         // Remove the caca bytes and try to fix the misalignment cause by it
     bool enable_header_fix = false;                         // Try to fix headers that fail the Hamming code test
+    EventPool* event_pool = nullptr;                        // Where to take memory for new events, when the handler keeps the processed ones
+    uint32_t max_bx_distance = 0;                           // Finish events this many bx counts behind the last header, 0 to disable
+    std::chrono::microseconds max_event_age {0};            // Finish events older than this, measured with the payload timestamps, 0 to disable
 
   private:
     static constexpr size_t queue_size = 16;
-    std::unordered_map<uint32_t, Event> m_event_pool {};
+    static constexpr size_t event_table_size = 64; // each queue holds at most one incomplete event
+    static constexpr uint32_t bx_count_range = 1U << 20U;
+    EventTable<event_table_size> m_events {};
     std::array<Queue, queue_size> m_queues {}; // where to store next queue data
     size_t m_processed_events = 0;
     size_t m_processed_payloads = 0;
+    size_t m_evicted_events = 0;
+    uint32_t m_last_bx_count = 0; // of the last valid header
     unsigned char m_alignment = 0;
     std::array<uint8_t, sizeof(Hit)> m_leftover {};
-    std::function<void(Event&&)> m_event_handler;
+    size_t m_payload_headers = 0; // headers in the current payload
+    bool m_header_dense = false;  // the last payload had many headers
+    Handler m_event_handler;
+    ColumnarEvent m_columnar_event {}; // only used by handlers taking a const ColumnarEvent&
   };
 
+  // Type erased assembler, any handler converts to it
+  using EventAssembler = BasicEventAssembler<std::function<void(Event&&)>>;
+
+  template <typename Handler>
+  BasicEventAssembler<Handler> make_event_assembler(Handler event_handler)
+  {
+    return BasicEventAssembler<Handler>(std::move(event_handler));
+  }
+
+  // Keeps the data stream of each FEC in its own EventAssembler, so their alignment and events never mix
+  template <typename Assembler>
+  class BasicStreamAssembler {
+  public:
+    // New streams get a copy of the prototype settings and event handler
+    explicit BasicStreamAssembler(const Assembler& prototype)
+      : m_prototype(prototype)
+    {
+    }
+
+    template <typename Data>
+    void process(BasicPayload<Data>& payload) { stream(stream_id(payload)).process(payload); }
+
+    // FEC that sent the payload, read before the caca bytes are removed
+    template <typename Data>
+    static uint8_t stream_id(const BasicPayload<Data>& payload)
+    {
+      const auto& data = payload.data;
+      size_t header_offset = 0;
+      if (!data.empty() && data[0] == 0xca) {
+	header_offset = static_cast<size_t>(std::find_if(data.begin(), data.end(), [](auto x) { return x != 0xcaU; }) - data.begin());
+      }
+      if (data.size() < header_offset + Payload::header_size) {
+	return 0;
+      }
+      return data[header_offset + 7] >> 4U;
+    }
+
+    size_t get_processed_events() const { return sum(&Assembler::get_processed_events); }
+    size_t get_evicted_events() const { return sum(&Assembler::get_evicted_events); }
+    size_t memory_use() const { return sum(&Assembler::memory_use); }
+
+    uint64_t state_digest() const
+    {
+      StateHash hash {};
+      for (const auto& assembler : m_streams) {
+	hash.add(assembler ? assembler->state_digest() : 0);
+      }
+      return hash.value();
+    }
+
+    static constexpr size_t max_streams = 16; // the fec_id has 4 bits
+
+  private:
+    Assembler& stream(uint8_t id)
+    {
+      auto& assembler = m_streams[id];
+      if (!assembler) {
+	assembler = std::make_unique<Assembler>(m_prototype);
+      }
+      return *assembler;
+    }
+
+    size_t sum(size_t (Assembler::*counter)() const) const
+    {
+      size_t total = 0;
+      for (const auto& assembler : m_streams) {
+	if (assembler) {
+	  total += ((*assembler).*counter)();
+	}
+      }
+      return total;
+    }
+
+    Assembler m_prototype;
+    std::array<std::unique_ptr<Assembler>, max_streams> m_streams {};
+  };
+
+  using StreamAssembler = BasicStreamAssembler<EventAssembler>;
+
 class ConfigVars{
 public:
   ConfigVars(const char* conffile = "");
@@ -733,6 +1433,13 @@ public:
   
   std::string mapfpath; //mapping file path
   int minsampa;   //number of first sampa
+  bool build_events; //merge the events of all FECs with the same bx_count
+  bool rntuple; //write an RNTuple instead of a TTree
+  bool flat_layout; //one samples array per event with offsets and lengths, float positions
+  int compression; //ROOT compression settings, 100 * algorithm + level, -1 for ROOT's default
+  int basket_size; //bytes, 0 for ROOT's default
+  int auto_flush; //entries if positive, bytes if negative, 0 for ROOT's default
+  int root_threads; //ROOT implicit multithreading, 0 to disable it
   
 };
   
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <sampasrs/decoder.hpp>
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+namespace sampasrs {
+
+struct EventBuilderConfig {
+  // FECs of a complete event, when empty all the FECs seen so far are expected
+  std::bitset<StreamAssembler::max_streams> required_fecs {};
+  // Build the events still missing some FECs after this time, measured with the event timestamps
+  std::chrono::microseconds timeout = std::chrono::milliseconds(10);
+  // Pass the events built without all FECs to the event handler, marked MissingFragment
+  bool process_incomplete_events = true;
+};
+
+// Merges the events of several FECs sharing a bx_count into one event, with a fragment for each FEC
+// The events of each FEC must come from their own assembler, e.g. a StreamAssembler
+class EventBuilder {
+  public:
+  using Config = EventBuilderConfig;
+
+  explicit EventBuilder(const std::function<void(Event&&)>& event_handler, const Config& config = {})
+      : m_event_handler(event_handler)
+      , m_config(config)
+  {
+  }
+
+  // The fragment is left empty, but keeps memory that can be recycled
+  void add(Event&& fragment)
+  {
+    m_fecs_seen.set(fragment.fec_id);
+    m_newest_timestamp = std::max(m_newest_timestamp, fragment.timestamp);
+    if (m_first_timestamp == 0) {
+      m_first_timestamp = fragment.timestamp;
+    }
+    ++m_fragments;
+
+    auto* event = m_events.find(fragment.bx_count);
+    if (event != nullptr && has_fec(*event, fragment.fec_id)) {
+      // The FEC already moved on to a new event with the same bx_count
+      build(*event);
+      event = nullptr;
+    }
+
+    if (event == nullptr) {
+      event = m_events.insert(fragment.bx_count);
+      if (event == nullptr) {
+        // No space left, the event in the way waited the longest
+        build(m_events.home_event(fragment.bx_count));
+        event = m_events.insert(fragment.bx_count);
+      }
+      // Take the fragment memory, the fragment gets the memory of the free slot
+      std::swap(event->hits, fragment.hits);
+      std::swap(event->waveform_begin, fragment.waveform_begin);
+      event->timestamp = fragment.timestamp;
+      event->fec_id = fragment.fec_id;
+      event->error = fragment.error;
+      event->fragments.push_back({fragment.fec_id, 0, event->waveform_count()});
+    } else {
+      append(*event, fragment);
+    }
+    fragment.clear();
+
+    if (knows_fecs() && (expected_fecs() & ~fecs(*event)).none()) {
+      build(*event);
+    }
+
+    // Look for timed out events only a few times per timeout
+    if (m_newest_timestamp - m_last_timeout_check > m_config.timeout.count() / 4) {
+      m_last_timeout_check = m_newest_timestamp;
+      build_timed_out_events();
+    }
+  }
+
+  // Build all the events still waiting for fragments, e.g. at the end of a file
+  void flush()
+  {
+    m_events.for_each([this](Event& event) { build(event); });
+  }
+
+  size_t get_built_events() const { return m_built_events; }
+  // Events built without the fragments of some FECs
+  size_t get_incomplete_events() const { return m_incomplete_events; }
+
+  private:
+  static constexpr size_t max_pending_events = 1024; // the slowest FEC may be many events behind
+
+  using FecSet = std::bitset<StreamAssembler::max_streams>;
+
+  static FecSet fecs(const Event& event)
+  {
+    FecSet fecs {};
+    for (const auto& fragment : event.fragments) {
+      fecs.set(fragment.fec_id);
+    }
+    return fecs;
+  }
+
+  static bool has_fec(const Event& event, uint8_t fec_id)
+  {
+    return std::any_of(event.fragments.begin(), event.fragments.end(),
+        [&](const auto& fragment) { return fragment.fec_id == fec_id; });
+  }
+
+  FecSet expected_fecs() const { return m_config.required_fecs.any() ? m_config.required_fecs : m_fecs_seen; }
+
+  // Without required FECs, the first events are only built by the timeout, until every FEC had time to send data
+  bool knows_fecs() const
+  {
+    return m_config.required_fecs.any()
+        || m_newest_timestamp - m_first_timestamp > m_config.timeout.count()
+        || m_fragments > max_pending_events;
+  }
+
+  static void append(Event& event, const Event& fragment)
+  {
+    const auto hit_offset = event.hits.size();
+    const auto first_waveform = event.waveform_count();
+    event.hits.insert(event.hits.end(), fragment.hits.begin(), fragment.hits.end());
+    for (auto begin : fragment.waveform_begin) {
+      event.waveform_begin.push_back(begin + hit_offset);
+    }
+    event.fragments.push_back({fragment.fec_id, first_waveform, fragment.waveform_count()});
+    event.timestamp = std::min(event.timestamp, fragment.timestamp);
+    event.error |= fragment.error;
+  }
+
+  void build_timed_out_events()
+  {
+    m_events.for_each([this](Event& event) {
+      if (m_newest_timestamp - event.timestamp > m_config.timeout.count()) {
+        build(event);
+      }
+    });
+  }
+
+  void build(Event& event)
+  {
+    if ((expected_fecs() & ~fecs(event)).any()) {
+      event.set_error(Event::MissingFragment);
+      ++m_incomplete_events;
+    }
+    if (event.error[Event::MissingFragment] == 0 || m_config.process_incomplete_events) {
+      m_event_handler(std::move(event));
+    }
+    m_events.erase(event);
+    ++m_built_events;
+  }
+
+  std::function<void(Event&&)> m_event_handler;
+  Config m_config;
+  EventTable<max_pending_events> m_events {};
+  FecSet m_fecs_seen {};
+  long m_first_timestamp = 0;
+  long m_newest_timestamp = 0;
+  long m_last_timeout_check = 0;
+  size_t m_fragments = 0;
+  size_t m_built_events = 0;
+  size_t m_incomplete_events = 0;
+};
+
+} // namespace sampasrs
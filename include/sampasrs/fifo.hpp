@@ -0,0 +1,458 @@
+#pragma once
+
+#include <boost/circular_buffer.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sampasrs {
+
+// What a buffer does with new elements when it is full
+enum class Overflow {
+  Block,      // wait until the consumer makes room
+  DropNewest, // discard the new element
+  DropOldest, // discard the oldest element in the buffer to make room
+};
+
+// Helper class to pass data between different threads
+template <typename T>
+class FIFO {
+  public:
+  FIFO() = default;
+
+  explicit FIFO(size_t buffer_size, size_t min_output, size_t max_output, Overflow overflow = Overflow::DropOldest)
+  {
+    config(buffer_size, min_output, max_output, overflow);
+  }
+
+  void config(size_t buffer_size, size_t min_output, size_t max_output, Overflow overflow = Overflow::DropOldest)
+  {
+    m_buffer.set_capacity(buffer_size);
+    m_min_output = min_output;
+    m_max_output = max_output;
+    m_overflow = overflow;
+    m_output.reserve(max_output);
+  }
+
+  // Retrieve elements from the buffer
+  [[nodiscard]] std::vector<T>& get(long timeout_milliseconds = 100)
+  {
+    m_output.clear();
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      // Wait until the buffer has enough elements, then acquire the lock
+      m_buffer_ready.wait_for(lock, std::chrono::milliseconds(timeout_milliseconds), [&] {
+        return m_buffer.size() >= m_min_output;
+      });
+
+      if (!m_buffer.empty()) {
+        // Move elements to output container
+        const size_t output_payloads = std::min(m_buffer.size(), m_max_output);
+        for (size_t i = 0; i < output_payloads; ++i) {
+          m_output.emplace_back(std::move(m_buffer.front()));
+          m_buffer.pop_front();
+        }
+      }
+    }
+
+    if (m_overflow == Overflow::Block && !m_output.empty()) {
+      m_space_ready.notify_all();
+    }
+    return m_output;
+  }
+
+  const boost::circular_buffer<T>& get_buffer() const { return m_buffer; };
+
+  // Returns false if the element was discarded
+  bool put(T&& element)
+  {
+    bool stored = false;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      stored = push(std::move(element), lock);
+    }
+    m_buffer_ready.notify_all();
+    return stored;
+  }
+
+  // Move a whole batch of elements into the buffer with a single lock
+  // Returns the number of discarded elements
+  size_t put(std::vector<T>& elements)
+  {
+    if (elements.empty()) {
+      return 0;
+    }
+    size_t discarded = 0;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      for (auto& element : elements) {
+        if (!push(std::move(element), lock)) {
+          ++discarded;
+        }
+      }
+    }
+    elements.clear();
+    m_buffer_ready.notify_all();
+    return discarded;
+  }
+
+  // Stop blocking the producer, called when the consumer stops reading
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_space_ready.notify_all();
+  }
+
+  size_t size() const { return m_buffer.size(); }
+  size_t capacity() const { return m_buffer.capacity(); }
+  bool empty() const { return size() == 0; }
+  bool enable() const { return capacity() != 0; }
+  // Number of elements lost because the buffer was full
+  size_t dropped() const { return m_dropped; }
+  Overflow overflow() const { return m_overflow; }
+
+  private:
+  bool push(T&& element, std::unique_lock<std::mutex>& lock)
+  {
+    if (m_buffer.full()) {
+      switch (m_overflow) {
+      case Overflow::Block:
+        m_buffer_ready.notify_all();
+        m_space_ready.wait(lock, [&] { return !m_buffer.full() || m_closed; });
+        if (m_buffer.full()) {
+          ++m_dropped;
+          return false;
+        }
+        break;
+      case Overflow::DropNewest:
+        ++m_dropped;
+        return false;
+      case Overflow::DropOldest:
+        // circular_buffer overwrites the oldest element
+        ++m_dropped;
+        break;
+      }
+    }
+    m_buffer.push_back(std::move(element));
+    return true;
+  }
+
+  boost::circular_buffer<T> m_buffer {};
+  std::vector<T> m_output {};
+  std::condition_variable m_buffer_ready {};
+  std::condition_variable m_space_ready {};
+  std::mutex m_mutex {};
+  size_t m_min_output {};
+  size_t m_max_output {};
+  Overflow m_overflow = Overflow::DropOldest;
+  bool m_closed = false;
+  std::atomic<size_t> m_dropped {0};
+};
+
+// Lock-free single producer, single consumer ring buffer with the same interface of FIFO
+// The producer only touches the lock when the consumer is parked waiting for data,
+// and the consumer spins for a short time before parking.
+// With Overflow::DropOldest the consumer also takes the lock while moving elements out,
+// since then the producer may advance the head of a full buffer.
+template <typename T>
+class SPSCQueue {
+  public:
+  SPSCQueue() = default;
+
+  explicit SPSCQueue(size_t buffer_size, size_t min_output, size_t max_output, Overflow overflow = Overflow::DropNewest)
+  {
+    config(buffer_size, min_output, max_output, overflow);
+  }
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  // Must be called before the producer and consumer threads start
+  void config(size_t buffer_size, size_t min_output, size_t max_output, Overflow overflow = Overflow::DropNewest)
+  {
+    size_t slots = 1;
+    while (slots < buffer_size) {
+      slots <<= 1U;
+    }
+    m_slots.clear();
+    m_slots.resize(buffer_size == 0 ? 0 : slots);
+    m_mask = slots - 1;
+    m_capacity = buffer_size;
+    m_min_output = std::max<size_t>(min_output, 1);
+    m_max_output = max_output;
+    m_overflow = overflow;
+    m_output.reserve(max_output);
+    m_head.store(0);
+    m_tail.store(0);
+    m_head_cache = 0;
+    m_tail_cache = 0;
+    m_dropped.store(0);
+    m_closed.store(false);
+  }
+
+  // Hand the discarded elements to recycle, e.g. to give their memory back to a pool, instead of freeing them
+  // Called from the producer thread, must be set before the producer and consumer threads start
+  void set_recycler(std::function<void(T&&)> recycle) { m_recycle = std::move(recycle); }
+
+  // Retrieve elements from the buffer, consumer thread only
+  [[nodiscard]] std::vector<T>& get(long timeout_milliseconds = 100)
+  {
+    m_output.clear();
+
+    if (!wait_for_elements(m_head.load(std::memory_order_relaxed), timeout_milliseconds)) {
+      return m_output;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+    if (m_overflow == Overflow::DropOldest) {
+      lock.lock();
+      m_tail_cache = m_tail.load(std::memory_order_acquire);
+    }
+
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t output_size = std::min(m_tail_cache - head, m_max_output);
+    for (size_t i = 0; i < output_size; ++i) {
+      m_output.emplace_back(std::move(m_slots[(head + i) & m_mask]));
+    }
+    m_head.store(head + output_size, std::memory_order_release);
+    return m_output;
+  }
+
+  // Producer thread only, returns false if the element was discarded
+  bool put(T&& element)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (!make_space(tail)) {
+      discard(std::move(element));
+      return false;
+    }
+    m_slots[tail & m_mask] = std::move(element);
+    publish(tail + 1);
+    return true;
+  }
+
+  // Move a whole batch of elements into the buffer, publishing them to the consumer at once
+  // Returns the number of discarded elements
+  size_t put(std::vector<T>& elements)
+  {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t discarded = 0;
+    for (auto& element : elements) {
+      if (!has_space(tail)) {
+        // Let the consumer see what we have so far before waiting or dropping
+        publish(tail);
+        if (!make_space(tail)) {
+          discard(std::move(element));
+          ++discarded;
+          continue;
+        }
+      }
+      m_slots[tail & m_mask] = std::move(element);
+      ++tail;
+    }
+    elements.clear();
+    publish(tail);
+    return discarded;
+  }
+
+  // Stop blocking the producer, called when the consumer stops reading
+  void close() { m_closed.store(true); }
+
+  size_t size() const
+  {
+    // Load head first, so the result is never negative
+    const size_t head = m_head.load(std::memory_order_acquire);
+    return m_tail.load(std::memory_order_acquire) - head;
+  }
+  size_t capacity() const { return m_capacity; }
+  bool empty() const { return size() == 0; }
+  bool enable() const { return capacity() != 0; }
+  // Number of elements lost because the buffer was full
+  size_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+  Overflow overflow() const { return m_overflow; }
+
+  private:
+  static constexpr size_t cache_line = 64;
+
+  // Spinning only helps if the producer runs in parallel
+  static int spin_iterations()
+  {
+    static const int iterations = std::thread::hardware_concurrency() > 1 ? 1000 : 0;
+    return iterations;
+  }
+
+  static void cpu_relax()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  bool has_space(size_t tail)
+  {
+    if (tail - m_head_cache < m_capacity) {
+      return true;
+    }
+    m_head_cache = m_head.load(std::memory_order_acquire);
+    return tail - m_head_cache < m_capacity;
+  }
+
+  // Apply the overflow policy to a full buffer, returns false if the new element must be discarded
+  bool make_space(size_t tail)
+  {
+    if (has_space(tail)) {
+      return true;
+    }
+
+    switch (m_overflow) {
+    case Overflow::Block:
+      for (int i = 0; !has_space(tail); ++i) {
+        if (m_closed.load(std::memory_order_relaxed) || m_capacity == 0) {
+          count_drop();
+          return false;
+        }
+        if (i < spin_iterations()) {
+          cpu_relax();
+        } else {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+      }
+      return true;
+
+    case Overflow::DropNewest:
+      count_drop();
+      return false;
+
+    case Overflow::DropOldest: {
+      if (m_capacity == 0) {
+        count_drop();
+        return false;
+      }
+      T oldest {};
+      bool full = false;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        full = tail - head == m_capacity;
+        if (full) {
+          oldest = std::move(m_slots[head & m_mask]);
+          ++head;
+          m_head.store(head, std::memory_order_release);
+          count_drop();
+        }
+        m_head_cache = head;
+      }
+      // Recycle outside the lock, the consumer may be waiting for it
+      if (full) {
+        discard(std::move(oldest));
+      }
+      return true;
+    }
+    }
+    return false;
+  }
+
+  void discard(T&& element)
+  {
+    if (m_recycle) {
+      m_recycle(std::move(element));
+    }
+  }
+
+  void count_drop() { m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+  void publish(size_t tail)
+  {
+    m_tail.store(tail, std::memory_order_release);
+
+    // Pairs with the fence in wait_for_elements: either the consumer sees the new tail
+    // or we see that it is parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_parked.load(std::memory_order_relaxed) && tail - m_head_cache >= m_min_output) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_buffer_ready.notify_one();
+    }
+  }
+
+  bool ready(size_t head)
+  {
+    m_tail_cache = m_tail.load(std::memory_order_acquire);
+    return m_tail_cache - head >= m_min_output;
+  }
+
+  // Spin for a while, then park until min_output elements are available or the timeout expires
+  bool wait_for_elements(size_t head, long timeout_milliseconds)
+  {
+    if (m_capacity == 0) {
+      return false;
+    }
+
+    for (int i = 0; i < spin_iterations(); ++i) {
+      if (ready(head)) {
+        return true;
+      }
+      cpu_relax();
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_parked.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      m_buffer_ready.wait_for(lock, std::chrono::milliseconds(timeout_milliseconds), [&] { return ready(head); });
+      m_parked.store(false, std::memory_order_relaxed);
+    }
+    return m_tail_cache != head;
+  }
+
+  // Producer and consumer indexes live in different cache lines to avoid false sharing
+  alignas(cache_line) std::atomic<size_t> m_tail {0};
+  size_t m_head_cache = 0; // producer copy of m_head
+  std::atomic<size_t> m_dropped {0};
+
+  alignas(cache_line) std::atomic<size_t> m_head {0};
+  size_t m_tail_cache = 0; // consumer copy of m_tail
+  std::atomic_bool m_parked {false};
+
+  alignas(cache_line) std::vector<T> m_slots {};
+  size_t m_mask = 0;
+  size_t m_capacity = 0;
+  size_t m_min_output = 1;
+  size_t m_max_output = 0;
+  Overflow m_overflow = Overflow::DropNewest;
+  std::atomic_bool m_closed {false};
+  std::vector<T> m_output {};
+  std::function<void(T&&)> m_recycle {};
+  std::condition_variable m_buffer_ready {};
+  std::mutex m_mutex {};
+};
+
+// Close a buffer when its consumer stops, so a blocked producer never waits forever
+template <typename Buffer>
+class ConsumerGuard {
+  public:
+  explicit ConsumerGuard(Buffer& buffer)
+      : m_buffer(buffer)
+  {
+  }
+  ConsumerGuard(const ConsumerGuard&) = delete;
+  ConsumerGuard& operator=(const ConsumerGuard&) = delete;
+  ~ConsumerGuard() { m_buffer.close(); }
+
+  private:
+  Buffer& m_buffer;
+};
+
+} // namespace sampasrs
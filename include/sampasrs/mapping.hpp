@@ -3,6 +3,7 @@
 #include <fstream>
 #include <cstring> 
 #include <cstdio>
+#include <unordered_map>
 #include <vector>
 #include <string>
  
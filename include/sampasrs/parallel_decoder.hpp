@@ -0,0 +1,281 @@
+#pragma once
+
+#include <sampasrs/decoder.hpp>
+#include <sampasrs/raw_file.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sampasrs {
+
+// The last records of a segment, the fewest that hold at least size bytes, or all of them
+// Payload records have no markers, so they are found by walking the record sizes from the start of a range
+inline std::vector<ByteView> payload_tail(const std::vector<ByteView>& ranges, size_t size)
+{
+  std::vector<ByteView> tail {};
+  for (auto range = ranges.rbegin(); range != ranges.rend() && size > 0; ++range) {
+    if (range->size() <= size) {
+      tail.push_back(*range);
+      size -= range->size();
+      continue;
+    }
+
+    // Only the end of this range is needed
+    MemoryInput input(range->data(), range->size());
+    size_t start = 0;
+    while (input.remaining() >= size) {
+      start = range->size() - input.remaining();
+      PayloadView::read(input);
+    }
+    tail.emplace_back(range->data() + start, range->size() - start);
+    size = 0;
+  }
+  std::reverse(tail.begin(), tail.end());
+  return tail;
+}
+
+// Consecutive parts of the records with about size bytes each, cut between payloads
+inline std::vector<std::vector<ByteView>> split_payloads(const std::vector<ByteView>& ranges, size_t size)
+{
+  std::vector<std::vector<ByteView>> parts(1);
+  size_t part_size = 0;
+  for (const auto& range : ranges) {
+    // Whole ranges, e.g. the blocks of an indexed file, are not walked
+    if (part_size + range.size() <= size) {
+      parts.back().push_back(range);
+      part_size += range.size();
+      continue;
+    }
+
+    MemoryInput input(range.data(), range.size());
+    size_t start = 0;
+    while (!input.eof()) {
+      const auto position = range.size() - input.remaining();
+      if (part_size + position - start >= size) {
+        if (position > start) {
+          parts.back().emplace_back(range.data() + start, position - start);
+        }
+        parts.emplace_back();
+        part_size = 0;
+        start = position;
+      }
+      PayloadView::read(input);
+    }
+    if (range.size() > start) {
+      parts.back().emplace_back(range.data() + start, range.size() - start);
+      part_size += range.size() - start;
+    }
+  }
+  if (parts.back().empty()) {
+    parts.pop_back();
+  }
+  return parts;
+}
+
+// Decodes consecutive segments of a run, e.g. its rotated files or parts of one file, on several threads,
+// with the same events as a single assembler decoding them one after the other
+//
+// The events open at the end of a segment are finished by the first payloads of the next one. So each segment
+// is decoded by an assembler first warmed up with the end of the previous segment, without output. Then, in
+// order, the state of each warmed up assembler is compared with the real one at the end of the previous segment.
+// The segments where they differ, e.g. because an event stayed open for longer than the warm up, are decoded
+// again from the real state. The events of .rawev segments are only read, they need no warm up.
+class SegmentedDecoder {
+  public:
+  using Sink = std::function<void(Event&&)>;
+
+  struct Segment {
+    std::vector<ByteView> records; // serialized records, in stream order
+    std::vector<ByteView> warm_up; // the last records of the previous segment, see payload_tail()
+  };
+
+  struct Result {
+    size_t input_bytes = 0;
+    size_t redone_segments = 0; // decoded again because the warm up was not enough
+  };
+
+  static constexpr size_t default_warm_up = 4U << 20U; // bytes, many events of every FEC
+
+  explicit SegmentedDecoder(raw_file::RecordType record_type = raw_file::RecordType::Payload)
+      : m_record_type(record_type)
+  {
+  }
+
+  // open_output(segment) gives the Sink of a segment, the events of each segment go to their own sink in order
+  // It is called from the worker threads, and again for the segments decoded again, whose previous events
+  // must then be dropped
+  // finish(segment) is called from this thread, in order, once the events of the segment are final. The workers
+  // stay at most twice as many segments as threads ahead of it, to bound the events kept by the sinks until then
+  template <typename OpenOutput, typename Finish>
+  Result decode(const std::vector<Segment>& segments, size_t threads, OpenOutput&& open_output, Finish&& finish)
+  {
+    threads = std::max<size_t>(threads, 1);
+    std::vector<std::unique_ptr<Job>> jobs {};
+    for (size_t i = 0; i < segments.size(); ++i) {
+      jobs.push_back(std::make_unique<Job>());
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t next_segment = 0;
+    size_t finished = 0;
+    bool stop = false;
+
+    auto worker = [&] {
+      while (true) {
+        size_t i = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&] { return stop || next_segment == segments.size() || next_segment < finished + 2 * threads; });
+          if (stop || next_segment == segments.size()) {
+            return;
+          }
+          i = next_segment++;
+        }
+
+        auto& job = *jobs[i];
+        try {
+          Assembler assembler(Forward {&job.sink});
+          assembler.process_invalid_events = true; // as sampa_decoder
+          job.sorter = std::make_unique<Sorter>(assembler);
+          feed(*job.sorter, segments[i].warm_up, job.sink);
+          job.start_state = job.sorter->state_digest();
+          job.sink = open_output(i);
+          job.input_bytes = feed(*job.sorter, segments[i].records, job.sink);
+        } catch (...) {
+          job.error = std::current_exception();
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          job.done = true;
+        }
+        changed.notify_all();
+      }
+    };
+
+    std::vector<std::thread> pool {};
+    for (size_t i = 0; i < std::min(threads, segments.size()); ++i) {
+      pool.emplace_back(worker);
+    }
+    auto stop_workers = [&] {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      changed.notify_all();
+      for (auto& thread : pool) {
+        thread.join();
+      }
+    };
+
+    Result result {};
+    Job* state = nullptr; // the real state at the end of the last finished segment
+    try {
+      for (size_t i = 0; i < jobs.size(); ++i) {
+        auto& job = *jobs[i];
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&] { return job.done; });
+        }
+        if (job.error) {
+          std::rethrow_exception(job.error);
+        }
+
+        if (state != nullptr && m_record_type == raw_file::RecordType::Payload
+            && job.start_state != state->sorter->state_digest()) {
+          ++result.redone_segments;
+          job.sorter.reset();
+          state->sink = open_output(i);
+          job.input_bytes = feed(*state->sorter, segments[i].records, state->sink);
+        } else {
+          if (state != nullptr) {
+            state->sorter.reset();
+          }
+          state = &job;
+        }
+        result.input_bytes += job.input_bytes;
+        finish(i);
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          finished = i + 1;
+        }
+        changed.notify_all();
+      }
+    } catch (...) {
+      stop_workers();
+      throw;
+    }
+    stop_workers();
+    return result;
+  }
+
+  private:
+  // The assembler handler, the sink of a job can change after the assembler is made
+  struct Forward {
+    Sink* sink;
+
+    void operator()(Event&& event) const
+    {
+      if (*sink) {
+        (*sink)(std::move(event));
+      }
+    }
+  };
+
+  using Assembler = BasicEventAssembler<Forward>;
+  using Sorter = BasicStreamAssembler<Assembler>;
+
+  struct Job {
+    Sink sink {}; // none while warming up
+    std::unique_ptr<Sorter> sorter {};
+    uint64_t start_state = 0; // after the warm up
+    size_t input_bytes = 0;
+    std::exception_ptr error {};
+    bool done = false;
+  };
+
+  // Decode the records of the ranges, returns the bytes read
+  size_t feed(Sorter& sorter, const std::vector<ByteView>& ranges, const Sink& sink) const
+  {
+    size_t bytes = 0;
+    Event event {}; // reused, unless the sink keeps it
+    for (const auto& range : ranges) {
+      MemoryInput input(range.data(), range.size());
+      while (!input.eof()) {
+        if (m_record_type == raw_file::RecordType::Event) {
+          Event::read(input, event);
+          if (!input) {
+            break;
+          }
+          bytes += event.byte_size();
+          if (sink) {
+            sink(std::move(event));
+          }
+        } else {
+          auto payload = PayloadView::read(input);
+          if (!input) {
+            break;
+          }
+          bytes += payload.byte_size();
+          sorter.process(payload);
+        }
+      }
+    }
+    return bytes;
+  }
+
+  raw_file::RecordType m_record_type;
+};
+
+} // namespace sampasrs
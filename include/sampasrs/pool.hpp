@@ -0,0 +1,117 @@
+#pragma once
+
+#include <sampasrs/decoder.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace sampasrs {
+
+// Recycles the payload buffers, so they are allocated once and then travel
+// between the reader thread, that fills them, and the last pipeline stage, that releases them.
+// Only one thread may acquire buffers, any thread may release them.
+class BufferPool {
+  public:
+  BufferPool() = default;
+
+  BufferPool(size_t buffer_count, size_t buffer_capacity, size_t max_buffers = default_max_buffers)
+  {
+    config(buffer_count, buffer_capacity, max_buffers);
+  }
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Preallocate buffer_count buffers with buffer_capacity bytes each
+  // At most max_buffers released buffers are kept, the rest is freed
+  void config(size_t buffer_count, size_t buffer_capacity, size_t max_buffers = default_max_buffers)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffer_capacity = buffer_capacity;
+    m_max_buffers = std::max(max_buffers, buffer_count);
+    m_free.reserve(m_max_buffers);
+    m_local.reserve(m_max_buffers);
+    while (m_free.size() < buffer_count) {
+      payload_data buffer {};
+      buffer.reserve(buffer_capacity);
+      m_free.push_back(std::move(buffer));
+    }
+  }
+
+  // Get an empty buffer, allocating a new one only if the pool is empty
+  payload_data acquire()
+  {
+    if (m_local.empty()) {
+      // Take all released buffers at once
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::swap(m_local, m_free);
+    }
+
+    if (m_local.empty()) {
+      m_allocations.fetch_add(1, std::memory_order_relaxed);
+      payload_data buffer {};
+      buffer.reserve(m_buffer_capacity);
+      return buffer;
+    }
+
+    m_reuses.fetch_add(1, std::memory_order_relaxed);
+    auto buffer = std::move(m_local.back());
+    m_local.pop_back();
+    return buffer;
+  }
+
+  // Get a buffer filled with a copy of the data
+  payload_data acquire(const uint8_t* data, size_t size)
+  {
+    auto buffer = acquire();
+    buffer.assign(data, data + size);
+    return buffer;
+  }
+
+  void release(payload_data&& buffer)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    recycle(std::move(buffer));
+  }
+
+  // Give back the buffers of all payloads with a single lock
+  void release(std::vector<Payload>& payloads)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& payload : payloads) {
+      recycle(std::move(payload.data));
+    }
+  }
+
+  // Buffers allocated because the pool was empty
+  size_t allocations() const { return m_allocations.load(std::memory_order_relaxed); }
+  // Buffers served from the pool
+  size_t reuses() const { return m_reuses.load(std::memory_order_relaxed); }
+
+  static constexpr size_t default_max_buffers = size_t(1) << 16U;
+
+  private:
+  void recycle(payload_data&& buffer)
+  {
+    if (buffer.capacity() == 0 || m_free.size() >= m_max_buffers) {
+      return;
+    }
+    buffer.clear();
+    m_free.push_back(std::move(buffer));
+  }
+
+  std::mutex m_mutex {};
+  std::vector<payload_data> m_free {};  // released buffers, protected by the mutex
+  std::vector<payload_data> m_local {}; // buffers owned by the acquiring thread
+  size_t m_buffer_capacity = 0;
+  size_t m_max_buffers = default_max_buffers;
+  std::atomic<size_t> m_allocations {0};
+  std::atomic<size_t> m_reuses {0};
+};
+
+} // namespace sampasrs
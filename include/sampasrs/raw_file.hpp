@@ -0,0 +1,321 @@
+#pragma once
+
+#include <sampasrs/decoder.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sampasrs {
+
+// Indexed raw files, .iraw for payloads and .irawev for events
+//
+//   header   magic "SAMPARAW", version, record type, block size
+//   blocks   records serialized as in the .raw and .rawev files, never split between blocks
+//   index    one entry per block: offset, size, records, timestamps, frame counters and bx counts
+//   trailer  index offset, number of blocks, magic "SAMPAIDX"
+//
+// Readers find the index from the end of the file and can seek to any block, e.g. to split the decoding
+// All numbers are in host byte order, as in the other raw files
+namespace raw_file {
+  constexpr std::array<char, 8> header_magic {'S', 'A', 'M', 'P', 'A', 'R', 'A', 'W'};
+  constexpr std::array<char, 8> trailer_magic {'S', 'A', 'M', 'P', 'A', 'I', 'D', 'X'};
+  constexpr uint32_t version = 1;
+  constexpr size_t header_size = 32;
+  constexpr size_t trailer_size = 24;
+
+  enum class RecordType : uint32_t {
+    Payload = 1,
+    Event = 2,
+  };
+
+  struct Header {
+    uint32_t version = raw_file::version;
+    RecordType record_type = RecordType::Payload;
+    uint64_t block_size = 0; // target size, blocks end on the first record past it
+  };
+
+  // What the index keeps of each record
+  struct RecordInfo {
+    long timestamp = 0;
+    uint32_t frame_counter = 0;
+    uint32_t bx_count = 0;
+  };
+
+  // bx_count of the payload blocks, the payloads are only decoded later
+  constexpr uint32_t unknown_bx_count = std::numeric_limits<uint32_t>::max();
+
+  inline RecordInfo record_info(const Payload& payload)
+  {
+    const uint32_t frame_counter = payload.data.size() >= Payload::header_size ? payload.frame_counter() : 0;
+    return {payload.timestamp, frame_counter, unknown_bx_count};
+  }
+
+  inline RecordInfo record_info(const Event& event)
+  {
+    return {event.timestamp, 0, event.bx_count};
+  }
+
+  struct Block {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint32_t records = 0;
+    uint32_t first_frame_counter = 0;
+    uint32_t last_frame_counter = 0;
+    uint32_t first_bx_count = 0;
+    uint32_t last_bx_count = 0;
+    long first_timestamp = 0;
+    long last_timestamp = 0;
+  };
+
+  template <typename Record>
+  constexpr RecordType record_type()
+  {
+    return std::is_same<Record, Event>::value ? RecordType::Event : RecordType::Payload;
+  }
+
+  // Builds the index while the records are written, Output is anything with the write of std::ofstream
+  class IndexBuilder {
+    public:
+    explicit IndexBuilder(RecordType record_type, size_t block_size = 4U << 20U)
+        : m_header {version, record_type, block_size}
+    {
+    }
+
+    template <typename Output>
+    void write_header(Output& file)
+    {
+      file.write(header_magic.data(), header_magic.size());
+      serialize(file, m_header.version);
+      serialize(file, static_cast<uint32_t>(m_header.record_type));
+      serialize(file, m_header.block_size);
+      serialize(file, uint64_t {0}); // reserved
+      m_blocks.clear();
+      m_open = false;
+    }
+
+    // The record was written between the begin and end offsets of the file
+    void add(const RecordInfo& info, size_t begin, size_t end)
+    {
+      if (!m_open) {
+        m_blocks.push_back({begin, 0, 0, info.frame_counter, info.frame_counter, info.bx_count, info.bx_count,
+            info.timestamp, info.timestamp});
+        m_open = true;
+      }
+      auto& block = m_blocks.back();
+      block.size = end - block.offset;
+      ++block.records;
+      block.last_frame_counter = info.frame_counter;
+      block.last_bx_count = info.bx_count;
+      block.first_timestamp = std::min(block.first_timestamp, info.timestamp);
+      block.last_timestamp = std::max(block.last_timestamp, info.timestamp);
+      if (block.size >= m_header.block_size) {
+        m_open = false;
+      }
+    }
+
+    // The index and the trailer, after the last record
+    template <typename Output>
+    void write_footer(Output& file, size_t offset)
+    {
+      for (const auto& block : m_blocks) {
+        serialize(file, block.offset);
+        serialize(file, block.size);
+        serialize(file, block.records);
+        serialize(file, block.first_frame_counter);
+        serialize(file, block.last_frame_counter);
+        serialize(file, block.first_bx_count);
+        serialize(file, block.last_bx_count);
+        serialize(file, uint32_t {0}); // padding
+        serialize(file, static_cast<int64_t>(block.first_timestamp));
+        serialize(file, static_cast<int64_t>(block.last_timestamp));
+      }
+      serialize(file, static_cast<uint64_t>(offset));
+      serialize(file, static_cast<uint64_t>(m_blocks.size()));
+      file.write(trailer_magic.data(), trailer_magic.size());
+    }
+
+    const std::vector<Block>& blocks() const { return m_blocks; }
+
+    private:
+    Header m_header;
+    std::vector<Block> m_blocks {};
+    bool m_open = false; // the last block takes more records
+  };
+
+  // Read only mapping of a whole file, the records are read in place with a MemoryInput
+  // The kernel reads ahead while the file is walked in order, without the copies and small reads of a stream
+  class MappedFile {
+    public:
+    // Throws std::runtime_error if the file can't be opened or mapped
+    explicit MappedFile(const std::string& file_name)
+    {
+#ifdef __linux__
+      const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        throw std::runtime_error("Unable to open " + file_name);
+      }
+      struct stat status {};
+      if (fstat(fd, &status) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Unable to open " + file_name);
+      }
+      m_size = static_cast<size_t>(status.st_size);
+      if (m_size > 0) {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+          ::close(fd);
+          throw std::runtime_error("Unable to map " + file_name);
+        }
+        m_data = static_cast<const uint8_t*>(data);
+        madvise(data, m_size, MADV_SEQUENTIAL); // larger read ahead, pages behind are dropped first
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+      ::close(fd); // the mapping keeps the file
+#else
+      throw std::runtime_error("Memory mapped files are only available on Linux");
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+#ifdef __linux__
+      if (m_data != nullptr) {
+        munmap(const_cast<uint8_t*>(m_data), m_size); // NOLINT
+      }
+#endif
+    }
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    // The bytes from offset, e.g. a block or a stripe, clipped to the end of the file
+    MemoryInput input(size_t offset = 0, size_t size = std::numeric_limits<size_t>::max()) const
+    {
+      offset = std::min(offset, m_size);
+      return {m_data + offset, std::min(size, m_size - offset)};
+    }
+
+    private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+  };
+
+  // Random access to the blocks of an indexed raw file
+  class Reader {
+    public:
+    // Throws std::runtime_error if the file is not a complete indexed raw file
+    explicit Reader(const std::string& file_name)
+        : m_file(file_name, std::ios::binary)
+    {
+      if (!m_file) {
+        throw std::runtime_error("Unable to open " + file_name);
+      }
+
+      std::array<char, 8> magic {};
+      m_file.read(magic.data(), magic.size());
+      uint32_t record_type = 0;
+      deserialize(m_file, m_header.version);
+      deserialize(m_file, record_type);
+      deserialize(m_file, m_header.block_size);
+      m_header.record_type = static_cast<RecordType>(record_type);
+      if (!m_file || magic != header_magic) {
+        throw std::runtime_error(file_name + " is not an indexed raw file");
+      }
+      if (m_header.version > version) {
+        throw std::runtime_error(file_name + " has an unsupported version " + std::to_string(m_header.version));
+      }
+
+      // A file without trailer was not closed, e.g. the acquisition crashed
+      m_file.seekg(-static_cast<std::streamoff>(trailer_size), std::ios::end);
+      uint64_t index_offset = 0;
+      uint64_t block_count = 0;
+      deserialize(m_file, index_offset);
+      deserialize(m_file, block_count);
+      m_file.read(magic.data(), magic.size());
+      if (!m_file || magic != trailer_magic) {
+        throw std::runtime_error(file_name + " has no index, it was not closed");
+      }
+
+      m_file.seekg(static_cast<std::streamoff>(index_offset));
+      m_blocks.resize(block_count);
+      for (auto& block : m_blocks) {
+        int64_t first_timestamp = 0;
+        int64_t last_timestamp = 0;
+        uint32_t padding = 0;
+        deserialize(m_file, block.offset);
+        deserialize(m_file, block.size);
+        deserialize(m_file, block.records);
+        deserialize(m_file, block.first_frame_counter);
+        deserialize(m_file, block.last_frame_counter);
+        deserialize(m_file, block.first_bx_count);
+        deserialize(m_file, block.last_bx_count);
+        deserialize(m_file, padding);
+        deserialize(m_file, first_timestamp);
+        deserialize(m_file, last_timestamp);
+        block.first_timestamp = static_cast<long>(first_timestamp);
+        block.last_timestamp = static_cast<long>(last_timestamp);
+      }
+      if (!m_file) {
+        throw std::runtime_error(file_name + " has a truncated index");
+      }
+    }
+
+    const Header& header() const { return m_header; }
+    const std::vector<Block>& blocks() const { return m_blocks; }
+
+    // First block that may hold records at or after the timestamp, blocks().size() if none
+    size_t find_block(long timestamp) const
+    {
+      const auto block = std::find_if(m_blocks.begin(), m_blocks.end(),
+          [&](const Block& candidate) { return candidate.last_timestamp >= timestamp; });
+      return static_cast<size_t>(block - m_blocks.begin());
+    }
+
+    // Call on_record(Record&) for the records of a block, Record is Payload or Event as in the header
+    // The record is reused, move from it to keep it
+    template <typename Record, typename Callback>
+    void read_block(size_t block, Callback&& on_record)
+    {
+      if (m_header.record_type != record_type<Record>()) {
+        throw std::runtime_error("Wrong record type for this indexed raw file");
+      }
+      const auto& info = m_blocks.at(block);
+      m_file.clear();
+      m_file.seekg(static_cast<std::streamoff>(info.offset));
+      Record record {};
+      for (uint32_t i = 0; i < info.records && m_file; ++i) {
+        if constexpr (std::is_same<Record, Event>::value) {
+          Event::read(m_file, record);
+        } else {
+          record = Payload::read(m_file);
+        }
+        on_record(record);
+      }
+    }
+
+    private:
+    std::ifstream m_file;
+    Header m_header {};
+    std::vector<Block> m_blocks {};
+  };
+} // namespace raw_file
+
+} // namespace sampasrs
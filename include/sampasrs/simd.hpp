@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace sampasrs {
+
+// Parity of a 64 bit word masked by eight masks at once, bit i of the result is parity(word & masks[i])
+// The parity is linear, so the result is the XOR of a table lookup for each byte of the word
+class ParityMatrix {
+  public:
+  explicit ParityMatrix(const std::array<uint64_t, 8>& masks)
+  {
+    for (size_t byte = 0; byte < 8; ++byte) {
+      for (unsigned int value = 0; value < 256; ++value) {
+        m_byte_table[byte][value] = column_parity(masks, static_cast<uint64_t>(value) << (8 * byte));
+      }
+      for (unsigned int value = 0; value < 16; ++value) {
+        m_low_nibble_table[byte][value] = m_byte_table[byte][value];
+        m_high_nibble_table[byte][value] = m_byte_table[byte][value << 4U];
+      }
+    }
+  }
+
+  uint8_t operator()(uint64_t word) const
+  {
+    uint8_t result = 0;
+    for (size_t byte = 0; byte < 8; ++byte) {
+      result ^= m_byte_table[byte][(word >> (8 * byte)) & 0xffU];
+    }
+    return result;
+  }
+
+  // Compute the parities of n_words big endian words, as they come from the network
+  void compute(const uint8_t* data, size_t n_words, uint8_t* output) const
+  {
+#ifdef __AVX2__
+    size_t i = 0;
+    for (; i + block_words <= n_words; i += block_words) {
+      compute_block(data + i * 8, output + i);
+    }
+
+    // Pad the last words to a full block
+    if (i < n_words) {
+      std::array<uint8_t, block_words * 8> block {};
+      std::array<uint8_t, block_words> block_output {};
+      std::memcpy(block.data(), data + i * 8, (n_words - i) * 8);
+      compute_block(block.data(), block_output.data());
+      std::memcpy(output + i, block_output.data(), n_words - i);
+    }
+#else
+    for (size_t i = 0; i < n_words; ++i) {
+      output[i] = (*this)(load_big_endian(data + i * 8));
+    }
+#endif
+  }
+
+  // compute() is faster than calling operator() for each word
+#ifdef __AVX2__
+  static constexpr bool vectorized = true;
+#else
+  static constexpr bool vectorized = false;
+#endif
+
+  private:
+  static uint8_t column_parity(const std::array<uint64_t, 8>& masks, uint64_t word)
+  {
+    uint8_t result = 0;
+    for (size_t i = 0; i < masks.size(); ++i) {
+      result |= static_cast<uint8_t>(__builtin_parityll(word & masks[i]) << i);
+    }
+    return result;
+  }
+
+  static uint64_t load_big_endian(const uint8_t* data)
+  {
+    uint64_t word = 0;
+    for (size_t byte = 0; byte < 8; ++byte) {
+      word = word << 8U | data[byte];
+    }
+    return word;
+  }
+
+#ifdef __AVX2__
+  static constexpr size_t block_words = 32;
+
+  // Transpose 32 words so each register holds the same byte of every word,
+  // then look up the two nibbles of each byte, 32 words at once
+  void compute_block(const uint8_t* data, uint8_t* output) const
+  {
+    // Pair the bytes of the two words in each 128 bit lane, most significant byte last
+    const auto pair_bytes = _mm256_setr_epi8(
+        7, 15, 6, 14, 5, 13, 4, 12, 3, 11, 2, 10, 1, 9, 0, 8,
+        7, 15, 6, 14, 5, 13, 4, 12, 3, 11, 2, 10, 1, 9, 0, 8);
+
+    // Lane 0 holds the words 0 to 15, lane 1 the words 16 to 31
+    __m256i rows[8];
+    for (size_t r = 0; r < 8; ++r) {
+      const auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * r));
+      const auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 128 + 16 * r));
+      rows[r] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1), pair_bytes);
+    }
+
+    // 2 words per byte -> 4 -> 8 -> 16
+    __m256i words4[8];
+    for (size_t r = 0; r < 4; ++r) {
+      words4[r] = _mm256_unpacklo_epi16(rows[2 * r], rows[2 * r + 1]);     // bytes 0 to 3
+      words4[r + 4] = _mm256_unpackhi_epi16(rows[2 * r], rows[2 * r + 1]); // bytes 4 to 7
+    }
+
+    __m256i words8[8];
+    for (size_t half = 0; half < 2; ++half) {
+      for (size_t r = 0; r < 2; ++r) {
+        const auto& a = words4[4 * half + 2 * r];
+        const auto& b = words4[4 * half + 2 * r + 1];
+        words8[4 * half + r] = _mm256_unpacklo_epi32(a, b);     // bytes 4 * half + 0, 1
+        words8[4 * half + r + 2] = _mm256_unpackhi_epi32(a, b); // bytes 4 * half + 2, 3
+      }
+    }
+
+    const auto nibble = _mm256_set1_epi8(0x0f);
+    auto result = _mm256_setzero_si256();
+    for (size_t pair = 0; pair < 4; ++pair) {
+      const auto& a = words8[2 * pair];
+      const auto& b = words8[2 * pair + 1];
+      const size_t byte = 2 * pair;
+      result = _mm256_xor_si256(result, lookup(_mm256_unpacklo_epi64(a, b), byte, nibble));
+      result = _mm256_xor_si256(result, lookup(_mm256_unpackhi_epi64(a, b), byte + 1, nibble));
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), result);
+  }
+
+  __m256i lookup(__m256i bytes, size_t byte, __m256i nibble) const
+  {
+    const auto low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_low_nibble_table[byte].data())));
+    const auto high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_high_nibble_table[byte].data())));
+    const auto low = _mm256_and_si256(bytes, nibble);
+    const auto high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+    return _mm256_xor_si256(_mm256_shuffle_epi8(low_table, low), _mm256_shuffle_epi8(high_table, high));
+  }
+#endif
+
+  std::array<std::array<uint8_t, 256>, 8> m_byte_table {};
+  std::array<std::array<uint8_t, 16>, 8> m_low_nibble_table {};
+  std::array<std::array<uint8_t, 16>, 8> m_high_nibble_table {};
+};
+
+// Unpacking of the 10 bit samples of SAMPA data hits, five per 64 bit hit
+namespace unpack_detail {
+  // Position of each sample in the hit, bits 30 and 31 are unused
+  constexpr std::array<unsigned int, 5> sample_bits {0, 10, 20, 32, 42};
+  constexpr size_t samples_per_hit = sample_bits.size();
+  constexpr uint64_t sample_mask = 0x3ffU;
+
+  // Byte of the hits array where a sample starts, in little endian memory
+  constexpr size_t sample_byte(size_t sample)
+  {
+    return 8 * (sample / samples_per_hit) + sample_bits[sample % samples_per_hit] / 8;
+  }
+
+  constexpr unsigned int sample_shift(size_t sample)
+  {
+    return sample_bits[sample % samples_per_hit] % 8;
+  }
+
+#ifdef __AVX2__
+  // 16 hits give 80 samples, stored as 5 registers of 16 samples.
+  // Each 128 bit lane takes its 8 samples from a 16 byte window of the hits:
+  // the two bytes of each sample are shuffled in place, then shifted and masked.
+  constexpr size_t block_hits = 16;
+  constexpr size_t block_registers = block_hits * samples_per_hit / 16;
+
+  struct Block {
+    std::array<size_t, 2 * block_registers> window {}; // first byte of each lane window
+    std::array<std::array<int8_t, 32>, block_registers> shuffle {};
+    std::array<std::array<int16_t, 16>, block_registers> multiplier {};
+    size_t last_byte = 0; // last byte read, past the block
+  };
+
+  constexpr Block make_block()
+  {
+    Block block {};
+    for (size_t r = 0; r < block_registers; ++r) {
+      for (size_t lane = 0; lane < 2; ++lane) {
+        const size_t first = 16 * r + 8 * lane;
+        const size_t window = sample_byte(first);
+        block.window[2 * r + lane] = window;
+        block.last_byte = std::max(block.last_byte, window + 15);
+        for (size_t i = 0; i < 8; ++i) {
+          const auto byte = static_cast<int8_t>(sample_byte(first + i) - window);
+          block.shuffle[r][16 * lane + 2 * i] = byte;
+          block.shuffle[r][16 * lane + 2 * i + 1] = static_cast<int8_t>(byte + 1);
+          // Shift left so the sample starts at bit 4, then all samples are shifted right by 4
+          block.multiplier[r][8 * lane + i] = static_cast<int16_t>(1U << (4 - sample_shift(first + i)));
+        }
+      }
+    }
+    return block;
+  }
+
+  inline constexpr Block block = make_block();
+
+  constexpr bool windows_fit()
+  {
+    for (size_t sample = 0; sample < block_hits * samples_per_hit; ++sample) {
+      const size_t window = block.window[sample / 8];
+      if (sample_byte(sample) + 1 >= window + 16 || sample_shift(sample) > 4) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static_assert(windows_fit(), "Every sample must be inside the 16 byte window of its lane");
+  static_assert(block.last_byte < 8 * (block_hits + 1), "A block may only read into the following hit");
+
+  // Decode register r from the two lane windows, already loaded
+  inline __m256i unpack_windows(__m256i words, size_t r)
+  {
+    words = _mm256_shuffle_epi8(words, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block.shuffle[r].data())));
+    words = _mm256_mullo_epi16(words, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block.multiplier[r].data())));
+    return _mm256_and_si256(_mm256_srli_epi16(words, 4), _mm256_set1_epi16(static_cast<int16_t>(sample_mask)));
+  }
+
+  inline __m256i unpack_register(const uint8_t* data, size_t r)
+  {
+    const auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + block.window[2 * r]));
+    const auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + block.window[2 * r + 1]));
+    return unpack_windows(_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1), r);
+  }
+
+  // Register r from its low lane window only, the high lane is garbage
+  inline __m256i unpack_low_lane(const uint8_t* data, size_t r)
+  {
+    const auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + block.window[2 * r]));
+    return unpack_windows(_mm256_castsi128_si256(low), r);
+  }
+
+  inline void unpack_block(const uint8_t* data, int16_t* samples)
+  {
+    for (size_t r = 0; r < block_registers; ++r) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples + 16 * r), unpack_register(data, r));
+    }
+  }
+
+  // The lane windows repeat every 8 hits, so the first 40 samples of a block are 8 hits on their own
+  constexpr size_t half_block_hits = block_hits / 2;
+  static_assert(block.window[5] == block.window[0] + 8 * half_block_hits, "The lane pattern must repeat every 8 hits");
+  static_assert(block.window[3] + 15 < 8 * (half_block_hits + 1) && block.window[4] + 15 < 8 * (half_block_hits + 1),
+      "A half block may only read into the following hit");
+
+  inline void unpack_half_block(const uint8_t* data, int16_t* samples)
+  {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples), unpack_register(data, 0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples + 16), unpack_register(data, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(samples + 32), _mm256_castsi256_si128(unpack_low_lane(data, 2)));
+  }
+
+  // Waveforms of one or two hits, the usual ones after zero suppression, are decoded from the hits loaded in a
+  // single register: the first lane window starts at the first hit and the second one inside the second hit
+  constexpr size_t short_hits = 2;
+  constexpr int second_window = static_cast<int>(block.window[1]);
+  static_assert(block.window[0] == 0 && block.window[1] < 8 * short_hits, "The lane windows must start in the two hits");
+  static_assert(sample_byte(short_hits * samples_per_hit - 1) + 1 < 8 * short_hits, "Every sample must be in the two hits");
+
+  // The lengths vary from waveform to waveform, so the loads and stores are masked instead of branching on them.
+  // Masked out elements are neither read nor written, even past the end of the hits or of the samples.
+  inline void unpack_short(const uint64_t* hits, size_t n_samples, int16_t* samples)
+  {
+    const auto n_hits = static_cast<int64_t>((n_samples + samples_per_hit - 1) / samples_per_hit);
+    const auto load_mask = _mm_cmpgt_epi64(_mm_set1_epi64x(n_hits), _mm_set_epi64x(1, 0));
+    const auto words = _mm_maskload_epi64(reinterpret_cast<const long long*>(hits), load_mask);
+    const auto windows = _mm256_inserti128_si256(_mm256_castsi128_si256(words), _mm_srli_si128(words, second_window), 1);
+    const auto decoded = unpack_windows(windows, 0);
+
+    // Whole pairs of samples as 32 bit elements, then the last sample again in case it is unpaired
+    const auto pairs = static_cast<int>(n_samples / 2);
+    const auto store_mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(pairs), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    _mm256_maskstore_epi32(reinterpret_cast<int*>(samples), store_mask, decoded);
+    alignas(32) std::array<int16_t, 16> last;
+    _mm256_store_si256(reinterpret_cast<__m256i*>(last.data()), decoded);
+    samples[n_samples - 1] = last[n_samples - 1];
+  }
+
+  // The five samples of a single hit, with the lane 0 pattern of the first register
+  inline void unpack_hit(const uint8_t* data, int16_t* samples)
+  {
+    const auto shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block.shuffle[0].data()));
+    const auto multiplier = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block.multiplier[0].data()));
+    auto words = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(data)), shuffle);
+    words = _mm_mullo_epi16(words, multiplier);
+    words = _mm_and_si128(_mm_srli_epi16(words, 4), _mm_set1_epi16(static_cast<int16_t>(sample_mask)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(samples), words);
+  }
+#endif
+} // namespace unpack_detail
+
+// Decode n_samples 10 bit samples from consecutive data hits, in host byte order
+inline void unpack_samples(const uint64_t* hits, size_t n_samples, int16_t* samples)
+{
+  using namespace unpack_detail;
+  size_t hit = 0;
+
+#ifdef __AVX2__
+  if (n_samples == 0) {
+    return;
+  }
+  if (n_samples <= short_hits * samples_per_hit) {
+    unpack_short(hits, n_samples, samples);
+    return;
+  }
+
+  // The last lane reads the first bytes of the next hit, so it must belong to the waveform
+  const auto* data = reinterpret_cast<const uint8_t*>(hits);
+  for (; (hit + block_hits) * samples_per_hit < n_samples; hit += block_hits) {
+    unpack_block(data + 8 * hit, samples + hit * samples_per_hit);
+  }
+
+  if ((hit + half_block_hits) * samples_per_hit < n_samples) {
+    unpack_half_block(data + 8 * hit, samples + hit * samples_per_hit);
+    hit += half_block_hits;
+  }
+
+  // One hit at a time, each store writes 8 samples and the next hit overwrites the last 3
+  for (; hit * samples_per_hit + 8 <= n_samples; ++hit) {
+    unpack_hit(data + 8 * hit, samples + hit * samples_per_hit);
+  }
+#endif
+
+  for (size_t sample = hit * samples_per_hit; sample < n_samples; ++sample) {
+    samples[sample] = static_cast<int16_t>((hits[sample / samples_per_hit] >> sample_bits[sample % samples_per_hit]) & sample_mask);
+  }
+}
+
+// Position of the first byte different from value, or size when there is none
+inline size_t find_first_not(const uint8_t* data, size_t size, uint8_t value)
+{
+  size_t i = 0;
+
+#ifdef __AVX2__
+  const auto pattern = _mm256_set1_epi8(static_cast<char>(value));
+  for (; i + 32 <= size; i += 32) {
+    const auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    const auto different = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, pattern)));
+    if (different != 0) {
+      return i + static_cast<size_t>(__builtin_ctz(different));
+    }
+  }
+#endif
+
+  for (; i < size && data[i] == value; ++i) {
+  }
+  return i;
+}
+
+// Hit alignments of a SAMPA data stream consistent with its constant bits, which must be zero in every hit:
+// bit 1 of the first byte and bit 6 of the fifth byte, pk11110q qqqq...
+// Bit k of the result is set when all the complete hits starting at data + k pass, the eight offsets are checked in one pass
+inline uint8_t valid_alignments(const uint8_t* data, size_t size)
+{
+  static constexpr uint8_t first_byte_bit = 0b00000010U;
+  static constexpr uint8_t fifth_byte_bit = 0b01000000U;
+  static constexpr size_t hit_size = 8;
+
+  // Bit k is set once a hit starting at offset k modulo 8 fails
+  uint32_t failed = 0;
+  size_t start = 0; // of the next hits to check
+
+#ifdef __AVX2__
+  // 32 hit starts at a time, the fifth bytes are loaded 4 bytes later so lane j always belongs to the hit starting at lane j
+  // The bytes are only ORed in the loop, the constant bits are masked once at the end
+  auto first = _mm256_setzero_si256();
+  auto fifth = _mm256_setzero_si256();
+  for (; start + 32 + hit_size - 1 <= size; start += 32) {
+    first = _mm256_or_si256(first, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + start)));
+    fifth = _mm256_or_si256(fifth, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + start + 4)));
+  }
+  const auto bits = _mm256_or_si256(_mm256_and_si256(first, _mm256_set1_epi8(static_cast<char>(first_byte_bit))),
+      _mm256_and_si256(fifth, _mm256_set1_epi8(static_cast<char>(fifth_byte_bit))));
+  failed = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, _mm256_setzero_si256())));
+  // Each offset modulo 8 appears four times in the 32 lanes
+  failed |= failed >> 16U;
+  failed |= failed >> 8U;
+#endif
+
+  for (; start + hit_size <= size; ++start) {
+    if ((data[start] & first_byte_bit) != 0 || (data[start + 4] & fifth_byte_bit) != 0) {
+      failed |= 1U << (start % hit_size);
+    }
+  }
+
+  return static_cast<uint8_t>(~failed);
+}
+
+} // namespace sampasrs
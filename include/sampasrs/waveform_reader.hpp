@@ -0,0 +1,276 @@
+#pragma once
+
+#include <sampasrs/root_fix.hpp>
+
+#include <TFile.h>
+#include <TKey.h>
+#include <TTree.h>
+#include <TTreeReader.h>
+#include <TTreeReaderArray.h>
+#include <TTreeReaderValue.h>
+
+#ifdef WITH_RNTUPLE
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RNTupleView.hxx>
+#endif
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace sampasrs {
+
+// Reads the waveforms written by sampa_decoder: a tree with the nested or the flat layout, or an RNTuple
+// The columns are those of the current event, views into the buffers of the ROOT reader valid until the next call to next()
+class WaveformReader {
+  public:
+  // Values of a column of the current event
+  template <typename T>
+  class Column {
+    public:
+    Column() = default;
+    Column(const T* data, size_t size)
+        : m_data(data)
+        , m_size(size)
+    {
+    }
+
+    size_t size() const { return m_size; }
+    T operator[](size_t i) const { return m_data[i]; }
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_size; }
+
+    private:
+    const T* m_data = nullptr;
+    size_t m_size = 0;
+  };
+
+  // The samples of a waveform, as one vector of the words branch
+  using Samples = Column<short>;
+
+  // Strip positions, double in the nested layout and float in the flat one and the RNTuple
+  class Positions {
+    public:
+    Positions() = default;
+    Positions(const double* data, size_t size)
+        : m_double(data)
+        , m_size(size)
+    {
+    }
+    Positions(const float* data, size_t size)
+        : m_float(data)
+        , m_size(size)
+    {
+    }
+
+    size_t size() const { return m_size; }
+    double operator[](size_t i) const { return m_double != nullptr ? m_double[i] : m_float[i]; }
+
+    private:
+    const double* m_double = nullptr;
+    const float* m_float = nullptr;
+    size_t m_size = 0;
+  };
+
+  enum class Format {
+    NestedTree,
+    FlatTree,
+    NTuple,
+  };
+
+  // Throws std::runtime_error if the file has no waveforms, or an RNTuple without RNTuple support
+  explicit WaveformReader(TFile& file)
+  {
+    auto* key = file.GetKey("waveform");
+    if (key == nullptr) {
+      throw std::runtime_error(std::string(file.GetName()) + " has no waveform tree");
+    }
+    if (std::string(key->GetClassName()).find("RNTuple") != std::string::npos) {
+#ifdef WITH_RNTUPLE
+      m_ntuple = std::make_unique<NTuple>(file.GetName());
+      m_format = Format::NTuple;
+      return;
+#else
+      throw std::runtime_error(std::string(file.GetName()) + " is an RNTuple, it needs ROOT 6.36 or newer");
+#endif
+    }
+
+    auto* tree = dynamic_cast<TTree*>(file.Get("waveform"));
+    if (tree == nullptr) {
+      throw std::runtime_error(std::string(file.GetName()) + " has no waveform tree");
+    }
+    m_tree = std::make_unique<Tree>(tree);
+    m_format = m_tree->flat ? Format::FlatTree : Format::NestedTree;
+  }
+
+  Format format() const { return m_format; }
+
+  Long64_t entries()
+  {
+#ifdef WITH_RNTUPLE
+    if (m_ntuple) {
+      return static_cast<Long64_t>(m_ntuple->reader->GetNEntries());
+    }
+#endif
+    return m_tree->reader.GetEntries();
+  }
+
+  // Load the next event, false after the last one
+  // Throws std::runtime_error if the samples of a flat event are out of range
+  bool next()
+  {
+    m_words.clear();
+#ifdef WITH_RNTUPLE
+    if (m_ntuple) {
+      return next_ntuple(*m_ntuple);
+    }
+#endif
+    return next_tree(*m_tree);
+  }
+
+  // Columns of the current event, one value per waveform
+  const std::vector<Samples>& words() const { return m_words; }
+  const Column<short>& sampa() const { return m_sampa; }
+  const Column<short>& channel() const { return m_channel; }
+  const Positions& x() const { return m_x; }
+  const Positions& y() const { return m_y; }
+
+  private:
+  struct Tree {
+    explicit Tree(TTree* tree)
+        : reader(tree)
+        , flat(tree->GetBranch("samples") != nullptr)
+        , sampa(reader, "sampa")
+        , channel(reader, "channel")
+    {
+      if (flat) {
+        samples.emplace(reader, "samples");
+        offset.emplace(reader, "offset");
+        length.emplace(reader, "length");
+        x_float.emplace(reader, "x");
+        y_float.emplace(reader, "y");
+      } else {
+        words.emplace(reader, "words");
+        x.emplace(reader, "x");
+        y.emplace(reader, "y");
+      }
+    }
+
+    TTreeReader reader;
+    bool flat;
+    TTreeReaderArray<short> sampa;
+    TTreeReaderArray<short> channel;
+
+    // Nested layout
+    std::optional<TTreeReaderValue<std::vector<std::vector<short>>>> words {};
+    std::optional<TTreeReaderArray<double>> x {};
+    std::optional<TTreeReaderArray<double>> y {};
+
+    // Flat layout
+    std::optional<TTreeReaderArray<short>> samples {};
+    std::optional<TTreeReaderArray<unsigned int>> offset {};
+    std::optional<TTreeReaderArray<unsigned short>> length {};
+    std::optional<TTreeReaderArray<float>> x_float {};
+    std::optional<TTreeReaderArray<float>> y_float {};
+  };
+
+#ifdef WITH_RNTUPLE
+  // The samples of each waveform are a collection, stored flat by RNTuple
+  struct NTuple {
+    explicit NTuple(const std::string& file_name)
+        : reader(ROOT::RNTupleReader::Open("waveform", file_name))
+        , sampa(reader->GetView<std::vector<short>>("sampa"))
+        , channel(reader->GetView<std::vector<short>>("channel"))
+        , x(reader->GetView<std::vector<float>>("x"))
+        , y(reader->GetView<std::vector<float>>("y"))
+        , samples(reader->GetView<std::vector<std::vector<short>>>("samples"))
+    {
+    }
+
+    std::unique_ptr<ROOT::RNTupleReader> reader;
+    ROOT::RNTupleView<std::vector<short>> sampa;
+    ROOT::RNTupleView<std::vector<short>> channel;
+    ROOT::RNTupleView<std::vector<float>> x;
+    ROOT::RNTupleView<std::vector<float>> y;
+    ROOT::RNTupleView<std::vector<std::vector<short>>> samples;
+    ROOT::NTupleSize_t entry = 0;
+  };
+
+  bool next_ntuple(NTuple& ntuple)
+  {
+    if (ntuple.entry >= ntuple.reader->GetNEntries()) {
+      return false;
+    }
+    const auto entry = ntuple.entry++;
+    const auto& sampa = ntuple.sampa(entry);
+    const auto& channel = ntuple.channel(entry);
+    const auto& x = ntuple.x(entry);
+    const auto& y = ntuple.y(entry);
+    m_sampa = {sampa.data(), sampa.size()};
+    m_channel = {channel.data(), channel.size()};
+    m_x = {x.data(), x.size()};
+    m_y = {y.data(), y.size()};
+    for (const auto& samples : ntuple.samples(entry)) {
+      m_words.emplace_back(samples.data(), samples.size());
+    }
+    return true;
+  }
+#endif
+
+  bool next_tree(Tree& tree)
+  {
+    if (!tree.reader.Next()) {
+      return false;
+    }
+    m_sampa = {data(tree.sampa), tree.sampa.GetSize()};
+    m_channel = {data(tree.channel), tree.channel.GetSize()};
+
+    if (!tree.flat) {
+      m_x = {data(*tree.x), tree.x->GetSize()};
+      m_y = {data(*tree.y), tree.y->GetSize()};
+      for (const auto& words : **tree.words) {
+        m_words.emplace_back(words.data(), words.size());
+      }
+      return true;
+    }
+
+    m_x = {data(*tree.x_float), tree.x_float->GetSize()};
+    m_y = {data(*tree.y_float), tree.y_float->GetSize()};
+    const auto* samples = data(*tree.samples);
+    const auto n_samples = tree.samples->GetSize();
+    auto& offset = *tree.offset;
+    auto& length = *tree.length;
+    for (size_t i = 0; i < offset.GetSize() && i < length.GetSize(); ++i) {
+      if (static_cast<size_t>(offset[i]) + length[i] > n_samples) {
+        throw std::runtime_error("Waveform samples out of range in entry " + std::to_string(tree.reader.GetCurrentEntry()));
+      }
+      m_words.emplace_back(samples + offset[i], length[i]);
+    }
+    return true;
+  }
+
+  // The values of a vector or array branch are contiguous in the reader buffer
+  template <typename T>
+  static const T* data(TTreeReaderArray<T>& array)
+  {
+    return array.GetSize() > 0 ? &array.At(0) : nullptr;
+  }
+
+  Format m_format = Format::NestedTree;
+  std::unique_ptr<Tree> m_tree {};
+#ifdef WITH_RNTUPLE
+  std::unique_ptr<NTuple> m_ntuple {};
+#endif
+
+  // Columns of the current event
+  std::vector<Samples> m_words {};
+  Column<short> m_sampa {};
+  Column<short> m_channel {};
+  Positions m_x {};
+  Positions m_y {};
+};
+
+} // namespace sampasrs
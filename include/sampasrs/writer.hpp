@@ -0,0 +1,1196 @@
+#pragma once
+
+#include <sampasrs/raw_file.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define SAMPA_HAS_IO_URING
+#endif
+#endif
+
+namespace sampasrs {
+
+// How the acquisition writes the raw and event files
+enum class WriterBackend {
+  Stream,  // std::ofstream, two buffered writes per payload
+  Block,   // payloads packed in large aligned blocks, written with O_DIRECT by a background thread
+  IoUring, // the same blocks, several writes in flight through io_uring, falls back to Block when unavailable
+};
+
+inline std::optional<WriterBackend> writer_backend_from_string(std::string_view name)
+{
+  if (name == "stream" || name.empty()) {
+    return WriterBackend::Stream;
+  }
+  if (name == "block") {
+    return WriterBackend::Block;
+  }
+  if (name == "io_uring") {
+    return WriterBackend::IoUring;
+  }
+  return {};
+}
+
+// Reserve disk space without changing the file size, so the file system doesn't allocate while writing
+// Not all file systems support it, the file is then allocated as usual
+inline void preallocate_file([[maybe_unused]] int fd, [[maybe_unused]] size_t bytes)
+{
+#ifdef __linux__
+  if (bytes > 0) {
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(bytes));
+  }
+#endif
+}
+
+#ifdef SAMPA_HAS_IO_URING
+// Minimal io_uring submission and completion rings, through the raw system calls
+// see: https://kernel.dk/io_uring.pdf
+class IoUring {
+  public:
+  // Throws when io_uring is not available, e.g. old kernels or blocked by a seccomp filter
+  explicit IoUring(unsigned int entries)
+  {
+    io_uring_params params {};
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+      throw_error("io_uring not available");
+    }
+
+    try {
+      m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+      m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      const bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single_map) {
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+      }
+      m_sq_ring = map(m_sq_size, IORING_OFF_SQ_RING);
+      m_cq_ring = single_map ? m_sq_ring : map(m_cq_size, IORING_OFF_CQ_RING);
+      m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+    } catch (...) {
+      release();
+      throw;
+    }
+
+    auto* sq = static_cast<char*>(m_sq_ring);
+    m_sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+    auto* cq = static_cast<char*>(m_cq_ring);
+    m_cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  ~IoUring() { release(); }
+
+  // Pin the buffers for the fixed writes, returns false when the kernel refuses, e.g. over RLIMIT_MEMLOCK
+  bool register_buffers(const std::vector<iovec>& buffers)
+  {
+    const auto result = syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size());
+    return result == 0;
+  }
+
+  // Whether the kernel knows the opcode, e.g. IORING_OP_WRITE only exists since Linux 5.6
+  // Unknown opcodes fail every request with -EINVAL, the probe itself needs Linux 5.6 too
+  bool supports(unsigned int opcode) const
+  {
+    constexpr size_t max_ops = 256;
+    std::vector<char> buffer(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, max_ops) != 0) {
+      return false;
+    }
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  // Queue a write, buffer is the index of a registered buffer or -1
+  // The caller must keep at most as many requests in flight as ring entries
+  void write(int fd, const char* data, size_t size, size_t offset, int buffer, uint64_t user_data)
+  {
+    const auto tail = *m_sq_tail;
+    const auto index = tail & m_sq_mask;
+    auto& sqe = m_sqes[index];
+    sqe = io_uring_sqe {};
+    sqe.opcode = buffer < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(data);
+    sqe.len = static_cast<uint32_t>(size);
+    sqe.off = offset;
+    sqe.buf_index = static_cast<uint16_t>(std::max(buffer, 0));
+    sqe.user_data = user_data;
+    m_sq_array[index] = index;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++m_to_submit;
+  }
+
+  // Submit the queued requests and optionally wait for some completions
+  void enter(unsigned int wait_for = 0)
+  {
+    const unsigned int flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0U;
+    while (syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_for, flags, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        throw_error("io_uring_enter failed");
+      }
+    }
+    m_to_submit = 0;
+  }
+
+  // Call on_completion(user_data, result) for every finished request, result is the written bytes or -errno
+  template <typename Callback>
+  size_t reap(Callback&& on_completion)
+  {
+    auto head = *m_cq_head;
+    const auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    for (; head != tail; ++head, ++count) {
+      const auto& cqe = m_cqes[head & m_cq_mask];
+      on_completion(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  private:
+  [[noreturn]] static void throw_error(const std::string& message)
+  {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+  }
+
+  void* map(size_t size, off_t offset) const
+  {
+    void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+    if (ring == MAP_FAILED) {
+      throw_error("Unable to map io_uring");
+    }
+    return ring;
+  }
+
+  void release()
+  {
+    if (m_sqes != nullptr) {
+      munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring) {
+      munmap(m_cq_ring, m_cq_size);
+    }
+    if (m_sq_ring != nullptr) {
+      munmap(m_sq_ring, m_sq_size);
+    }
+    m_sqes = nullptr;
+    m_cq_ring = m_sq_ring = nullptr;
+    if (m_fd >= 0) {
+      ::close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  int m_fd = -1;
+  void* m_sq_ring = nullptr;
+  void* m_cq_ring = nullptr;
+  io_uring_sqe* m_sqes = nullptr;
+  size_t m_sq_size = 0;
+  size_t m_cq_size = 0;
+  size_t m_sqes_size = 0;
+  unsigned int* m_sq_tail = nullptr;
+  unsigned int* m_sq_array = nullptr;
+  unsigned int m_sq_mask = 0;
+  unsigned int* m_cq_head = nullptr;
+  unsigned int* m_cq_tail = nullptr;
+  io_uring_cqe* m_cqes = nullptr;
+  unsigned int m_cq_mask = 0;
+  unsigned int m_to_submit = 0;
+};
+#endif
+
+// Output file written in large blocks, the same bytes as an std::ofstream
+// The caller only copies data into the current block, full blocks are written by an I/O thread,
+// or submitted to io_uring, while the next ones are filled, so packing overlaps the disk writes
+// With O_DIRECT the page cache is bypassed, the blocks and file offsets are aligned for it
+// The file is created by the constructor, the blocks and the I/O thread only by start() or the first write(),
+// so a file created ahead of time holds no buffers
+class BlockWriter {
+  public:
+  struct Config {
+    size_t block_size = 8U << 20U; // bytes, a multiple of the alignment
+    size_t block_count = 4;        // blocks being filled or written, at least 2
+    size_t alignment = 4096;       // of the O_DIRECT buffers, offsets and sizes
+    bool direct_io = true;         // falls back to buffered writes when the file system doesn't support it
+    size_t preallocate = 0;        // bytes reserved on disk when the file is created, the unused ones are released on close
+    bool io_uring = false;         // submit the writes from the writing thread through io_uring, when available
+  };
+
+  explicit BlockWriter(const std::string& file_name)
+      : BlockWriter(file_name, Config {})
+  {
+  }
+
+  BlockWriter(const std::string& file_name, const Config& config)
+      : m_config(config)
+  {
+    if (m_config.block_size == 0 || m_config.block_size % m_config.alignment != 0) {
+      throw std::invalid_argument("The block size must be a multiple of the alignment");
+    }
+    m_config.block_count = std::max<size_t>(m_config.block_count, 2);
+
+#ifdef __linux__
+    const int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    if (m_config.direct_io) {
+      m_fd = ::open(file_name.c_str(), flags | O_DIRECT, 0644);
+      if (m_fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs, the file was not created
+        m_config.direct_io = false;
+      }
+    }
+    if (m_fd < 0 && !m_config.direct_io) {
+      m_fd = ::open(file_name.c_str(), flags, 0644);
+    }
+    if (m_fd < 0) {
+      throw_error("Unable to create " + file_name);
+    }
+    preallocate_file(m_fd, m_config.preallocate);
+#else
+    throw std::runtime_error("Block writer is only available on Linux");
+#endif
+  }
+
+  BlockWriter(const BlockWriter&) = delete;
+  BlockWriter& operator=(const BlockWriter&) = delete;
+
+  ~BlockWriter()
+  {
+    try {
+      close();
+    } catch (const std::runtime_error&) {
+      // Destructors can't report errors, call close() to see them
+    }
+  }
+
+  // Allocate the blocks and start the I/O thread or io_uring, does nothing if already started
+  void start()
+  {
+    if (!m_blocks.empty()) {
+      return;
+    }
+    try {
+      for (size_t i = 0; i < m_config.block_count; ++i) {
+        m_blocks.push_back(Block {make_buffer(), 0});
+        m_free.push_back(i);
+      }
+    } catch (const std::bad_alloc&) {
+      m_blocks.clear();
+      m_free.clear();
+      throw std::runtime_error("Unable to allocate the blocks of the file");
+    }
+
+    if (m_config.io_uring) {
+      m_config.io_uring = setup_io_uring();
+    }
+    m_current = take_free_block();
+    if (!m_config.io_uring) {
+      m_io_thread = std::thread(&BlockWriter::io_task, this);
+    }
+  }
+
+  // Same interface as std::ofstream::write
+  BlockWriter& write(const char* data, std::streamsize size)
+  {
+    start();
+    auto remaining = static_cast<size_t>(size);
+    while (remaining > 0) {
+      auto& block = m_blocks[m_current];
+      const auto n = std::min(remaining, m_config.block_size - block.used);
+      std::memcpy(block.data.get() + block.used, data, n);
+      block.used += n;
+      data += n;
+      remaining -= n;
+      if (block.used == m_config.block_size) {
+        submit(m_current);
+        m_current = take_free_block();
+      }
+    }
+    m_size += static_cast<size_t>(size);
+    return *this;
+  }
+
+  // Write the last partial block, wait for the I/O thread and close the file
+  // The thread is joined and the file closed even after a write error, which is only thrown then
+  void close()
+  {
+    if (m_fd < 0) {
+      return;
+    }
+    std::exception_ptr error {};
+    try {
+      if (!m_blocks.empty() && m_blocks[m_current].used > 0 && m_io_error == 0) {
+        queue_block(m_current);
+      }
+      if (m_config.io_uring) {
+        wait_io_uring();
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+    if (m_io_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+      }
+      m_wake_io.notify_one();
+      m_io_thread.join();
+    }
+
+#ifdef __linux__
+    // The last block was padded to the alignment, the truncation also releases the preallocated space
+    const bool failed = ftruncate(m_fd, static_cast<off_t>(m_size)) != 0 || fsync(m_fd) != 0;
+    const int finish_error = errno;
+    ::close(m_fd);
+    m_fd = -1;
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    check_io_error();
+    if (failed) {
+      errno = finish_error;
+      throw_error("Unable to finish the file");
+    }
+#else
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    check_io_error();
+#endif
+  }
+
+  // Bytes written so far, including the ones still in the blocks
+  size_t size() const { return m_size; }
+  bool direct_io() const { return m_config.direct_io; }
+  // Known once started, before it is whether io_uring was requested
+  bool uses_io_uring() const { return m_config.io_uring; }
+
+  private:
+  struct FreeBuffer {
+    void operator()(char* data) const { std::free(data); } // NOLINT
+  };
+
+  struct Block {
+    std::unique_ptr<char, FreeBuffer> data;
+    size_t used = 0;
+    // Write in flight through io_uring
+    size_t file_offset = 0;
+    size_t write_size = 0;
+    size_t written = 0;
+  };
+
+  [[noreturn]] static void throw_error(const std::string& message)
+  {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+  }
+
+  std::unique_ptr<char, FreeBuffer> make_buffer() const
+  {
+    auto* data = static_cast<char*>(std::aligned_alloc(m_config.alignment, m_config.block_size));
+    if (data == nullptr) {
+      throw std::bad_alloc();
+    }
+    return std::unique_ptr<char, FreeBuffer>(data);
+  }
+
+  // Only the last block is partial, O_DIRECT needs it padded to the alignment
+  size_t pad_block(Block& block) const
+  {
+    const auto size = (block.used + m_config.alignment - 1) / m_config.alignment * m_config.alignment;
+    std::fill(block.data.get() + block.used, block.data.get() + size, 0);
+    return size;
+  }
+
+  void submit(size_t block)
+  {
+    check_io_error();
+    queue_block(block);
+  }
+
+  void queue_block(size_t block)
+  {
+    if (m_config.io_uring) {
+      submit_io_uring(block);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending.push_back(block);
+    }
+    m_wake_io.notify_one();
+  }
+
+  // Waits when all blocks are being written, the disk is slower than the data
+  size_t take_free_block()
+  {
+    if (m_config.io_uring) {
+      // Only the writing thread touches the blocks
+      reap_completions(0);
+      while (m_free.empty()) {
+        reap_completions(1);
+      }
+      const auto block = m_free.front();
+      m_free.pop_front();
+      return block;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_block_freed.wait(lock, [this] { return !m_free.empty(); });
+    const auto block = m_free.front();
+    m_free.pop_front();
+    return block;
+  }
+
+  void check_io_error() const
+  {
+    const auto error = m_io_error.load();
+    if (error != 0) {
+      throw std::runtime_error(std::string("Unable to write file: ") + std::strerror(error));
+    }
+  }
+
+  void io_task()
+  {
+    size_t offset = 0;
+    while (true) {
+      size_t index = 0;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake_io.wait(lock, [this] { return !m_pending.empty() || m_closing; });
+        if (m_pending.empty()) {
+          return;
+        }
+        index = m_pending.front();
+        m_pending.pop_front();
+      }
+
+      auto& block = m_blocks[index];
+      if (m_io_error == 0) {
+        const auto size = pad_block(block);
+        write_all(block.data.get(), size, offset);
+        offset += size;
+      }
+      block.used = 0;
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(index);
+      }
+      m_block_freed.notify_one();
+    }
+  }
+
+  bool setup_io_uring()
+  {
+#ifdef SAMPA_HAS_IO_URING
+    try {
+      m_ring = std::make_unique<IoUring>(static_cast<unsigned int>(m_config.block_count));
+    } catch (const std::runtime_error&) {
+      return false;
+    }
+    std::vector<iovec> buffers {};
+    for (auto& block : m_blocks) {
+      buffers.push_back({block.data.get(), m_config.block_size});
+    }
+    m_fixed_buffers = m_ring->register_buffers(buffers);
+
+    // Without the write opcode the I/O thread writes the blocks instead
+    if (!m_ring->supports(m_fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)) {
+      m_ring.reset();
+      m_fixed_buffers = false;
+      return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void submit_io_uring([[maybe_unused]] size_t index)
+  {
+#ifdef SAMPA_HAS_IO_URING
+    auto& block = m_blocks[index];
+    block.write_size = pad_block(block);
+    block.written = 0;
+    block.file_offset = m_file_offset;
+    m_file_offset += block.write_size;
+    queue_write(index);
+    m_ring->enter();
+#endif
+  }
+
+#ifdef SAMPA_HAS_IO_URING
+  void queue_write(size_t index)
+  {
+    const auto& block = m_blocks[index];
+    const auto buffer = m_fixed_buffers ? static_cast<int>(index) : -1;
+    m_ring->write(m_fd, block.data.get() + block.written, block.write_size - block.written,
+        block.file_offset + block.written, buffer, index);
+    ++m_in_flight;
+  }
+#endif
+
+  void wait_io_uring()
+  {
+#ifdef SAMPA_HAS_IO_URING
+    while (m_in_flight > 0) {
+      reap_completions(1);
+    }
+#endif
+  }
+
+  // Free the blocks already written, after waiting for at least wait_for of them
+  void reap_completions([[maybe_unused]] unsigned int wait_for)
+  {
+#ifdef SAMPA_HAS_IO_URING
+    if (wait_for > 0) {
+      m_ring->enter(wait_for);
+    }
+    bool resubmit = false;
+    m_ring->reap([&](uint64_t index, int result) {
+      --m_in_flight;
+      auto& block = m_blocks[index];
+      if (result < 0 && m_io_error == 0) {
+        m_io_error = -result;
+      } else if (result == 0 && m_io_error == 0) {
+        m_io_error = EIO;
+      } else if (result > 0) {
+        block.written += static_cast<size_t>(result);
+        if (block.written < block.write_size) {
+          // Short write, the rest goes in a new request
+          queue_write(index);
+          resubmit = true;
+          return;
+        }
+      }
+      block.used = 0;
+      m_free.push_back(index);
+    });
+    if (resubmit) {
+      m_ring->enter();
+    }
+#endif
+  }
+
+  void write_all(const char* data, size_t size, size_t offset)
+  {
+#ifdef __linux__
+    while (size > 0) {
+      const auto written = pwrite(m_fd, data, size, static_cast<off_t>(offset));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        m_io_error = errno;
+        return;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+      offset += static_cast<size_t>(written);
+    }
+#endif
+  }
+
+  Config m_config {};
+  int m_fd = -1;
+  size_t m_size = 0;
+  std::vector<Block> m_blocks {};
+  size_t m_current = 0; // block being filled
+
+  std::mutex m_mutex {};
+  std::condition_variable m_wake_io {};
+  std::condition_variable m_block_freed {};
+  std::deque<size_t> m_pending {}; // full blocks, in file order
+  std::deque<size_t> m_free {};
+  bool m_closing = false;
+  std::atomic<int> m_io_error {0}; // errno of the first failed write
+  std::thread m_io_thread {};
+
+#ifdef SAMPA_HAS_IO_URING
+  std::unique_ptr<IoUring> m_ring {}; // destroyed before the blocks it writes
+  bool m_fixed_buffers = false;
+  size_t m_file_offset = 0;
+  size_t m_in_flight = 0;
+#endif
+};
+
+// Why an output file could not be created or written
+class OutputFileError : public std::runtime_error {
+  public:
+  enum Reason {
+    Exists,
+    NoDirectory,
+    Open,
+    Write,
+  };
+
+  OutputFileError(Reason reason, const std::string& message)
+      : std::runtime_error(message)
+      , m_reason(reason)
+  {
+  }
+
+  Reason reason() const { return m_reason; }
+
+  private:
+  Reason m_reason;
+};
+
+// Raw or event file written with either backend
+class OutputFile {
+  public:
+  struct Config {
+    WriterBackend backend = WriterBackend::Stream;
+    BlockWriter::Config block_writer {};
+    size_t preallocate = 0; // bytes reserved on disk when the file is created
+  };
+
+  OutputFile(const std::string& file_name, const Config& config)
+      : m_name(file_name)
+  {
+    const auto path = std::filesystem::absolute(file_name);
+    if (std::filesystem::exists(path)) {
+      throw OutputFileError(OutputFileError::Exists, "File \"" + file_name + "\" exists");
+    }
+    if (!std::filesystem::is_directory(path.parent_path())) {
+      throw OutputFileError(OutputFileError::NoDirectory, "Directory " + path.parent_path().string() + " don't exists");
+    }
+
+    if (config.backend == WriterBackend::Block || config.backend == WriterBackend::IoUring) {
+      auto block_config = config.block_writer;
+      block_config.preallocate = config.preallocate;
+      block_config.io_uring = config.backend == WriterBackend::IoUring;
+      try {
+        m_block = std::make_unique<BlockWriter>(file_name, block_config);
+      } catch (const std::runtime_error& error) {
+        throw OutputFileError(OutputFileError::Open, error.what());
+      }
+      return;
+    }
+
+#ifdef __linux__
+    // Created here to reserve the space, the stream opens it without truncating
+    const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw OutputFileError(OutputFileError::Open, "Unable to create " + file_name + ": " + std::strerror(errno));
+    }
+    preallocate_file(fd, config.preallocate);
+    ::close(fd);
+    m_stream.open(file_name, std::ios::binary | std::ios::in | std::ios::out);
+#else
+    m_stream.open(file_name, std::ios::binary);
+#endif
+    if (!m_stream) {
+      throw OutputFileError(OutputFileError::Open, "Unable to create " + file_name);
+    }
+  }
+
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  ~OutputFile()
+  {
+    try {
+      close();
+    } catch (const std::runtime_error&) {
+      // Destructors can't report errors, call close() to see them
+    }
+  }
+
+  // Get ready to write, the block writers allocate their buffers here or on the first write
+  // Throws OutputFileError
+  void start()
+  {
+    if (m_block) {
+      try {
+        m_block->start();
+      } catch (const std::runtime_error& error) {
+        throw OutputFileError(OutputFileError::Open, error.what());
+      }
+    }
+  }
+
+  // Same interface as std::ofstream::write, throws OutputFileError
+  OutputFile& write(const char* data, std::streamsize size)
+  {
+    if (m_block) {
+      try {
+        m_block->write(data, size);
+      } catch (const std::runtime_error& error) {
+        throw OutputFileError(OutputFileError::Write, error.what());
+      }
+    } else {
+      m_stream.write(data, size);
+    }
+    m_size += static_cast<size_t>(size);
+    return *this;
+  }
+
+  // Write everything to the disk and release the unused preallocated space
+  void close()
+  {
+    if (m_block) {
+      auto block = std::move(m_block);
+      try {
+        block->close();
+      } catch (const std::runtime_error& error) {
+        throw OutputFileError(OutputFileError::Write, error.what());
+      }
+      return;
+    }
+    if (!m_stream.is_open()) {
+      return;
+    }
+    m_stream.close();
+    const bool stream_failed = m_stream.fail();
+
+#ifdef __linux__
+    const int fd = ::open(m_name.c_str(), O_WRONLY | O_CLOEXEC);
+    const bool failed = fd < 0 || ftruncate(fd, static_cast<off_t>(m_size)) != 0 || fsync(fd) != 0;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    if (failed) {
+      throw OutputFileError(OutputFileError::Write, "Unable to finish " + m_name + ": " + std::strerror(errno));
+    }
+#endif
+    if (stream_failed) {
+      throw OutputFileError(OutputFileError::Write, "Unable to write " + m_name);
+    }
+  }
+
+  const std::string& name() const { return m_name; }
+  size_t size() const { return m_size; }
+  bool uses_io_uring() const { return m_block && m_block->uses_io_uring(); }
+
+  private:
+  std::string m_name {};
+  size_t m_size = 0;
+  std::ofstream m_stream {};
+  std::unique_ptr<BlockWriter> m_block {};
+};
+
+// Creates the next output files ahead of time and closes the finished ones, both on a background thread,
+// so rotating the output is only swapping pointers and the writer never waits for the file system
+class FileRotator {
+  public:
+  using Config = OutputFile::Config;
+
+  FileRotator(std::function<std::string()> next_name, const Config& config)
+      : m_next_name(std::move(next_name))
+      , m_config(config)
+      , m_thread(&FileRotator::task, this)
+  {
+  }
+
+  FileRotator(const FileRotator&) = delete;
+  FileRotator& operator=(const FileRotator&) = delete;
+
+  ~FileRotator() { stop(); }
+
+  // Waits until the next file is ready, throws OutputFileError if it could not be created
+  std::unique_ptr<OutputFile> next()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_wake.wait(lock, [this] { return m_prepared || m_error || m_stop; });
+    if (m_error) {
+      std::rethrow_exception(m_error);
+    }
+    if (!m_prepared) {
+      throw OutputFileError(OutputFileError::Open, "The output is closed");
+    }
+    auto file = std::move(m_prepared);
+    lock.unlock();
+    m_wake.notify_all(); // prepare the following one
+    return file;
+  }
+
+  // Close the file in the background
+  void retire(std::unique_ptr<OutputFile> file)
+  {
+    if (!file) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_retired.push_back(std::move(file));
+    }
+    m_wake.notify_all();
+  }
+
+  // Throws the first error found while closing the retired files
+  void check_errors()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_close_error) {
+      std::rethrow_exception(std::exchange(m_close_error, nullptr));
+    }
+  }
+
+  // Waits until all retired files are closed and removes the prepared one, which was never written
+  // Throws the first error found while closing them
+  void close()
+  {
+    stop();
+    check_errors();
+  }
+
+  private:
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join(); // after closing the retired files
+    }
+
+    if (m_prepared) {
+      const auto name = m_prepared->name();
+      m_prepared.reset();
+      std::error_code error {};
+      std::filesystem::remove(name, error);
+    }
+  }
+
+  void task()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      m_wake.wait(lock, [this] { return m_stop || (!m_prepared && !m_error) || !m_retired.empty(); });
+
+      // Preparing first, the writer may be waiting for it
+      if (!m_prepared && !m_error && !m_stop) {
+        lock.unlock();
+        std::unique_ptr<OutputFile> file {};
+        std::exception_ptr error {};
+        try {
+          file = std::make_unique<OutputFile>(m_next_name(), m_config);
+        } catch (const OutputFileError&) {
+          error = std::current_exception();
+        }
+        lock.lock();
+        m_prepared = std::move(file);
+        m_error = error;
+        m_wake.notify_all();
+        continue;
+      }
+
+      if (!m_retired.empty()) {
+        auto file = std::move(m_retired.front());
+        m_retired.pop_front();
+        lock.unlock();
+        std::exception_ptr error {};
+        try {
+          file->close();
+        } catch (const OutputFileError&) {
+          error = std::current_exception();
+        }
+        file.reset();
+        lock.lock();
+        if (error && !m_close_error) {
+          m_close_error = error;
+        }
+        continue;
+      }
+
+      if (m_stop) {
+        return;
+      }
+    }
+  }
+
+  std::function<std::string()> m_next_name;
+  Config m_config {};
+  std::mutex m_mutex {};
+  std::condition_variable m_wake {};
+  std::unique_ptr<OutputFile> m_prepared {};
+  std::exception_ptr m_error {};       // of the file being prepared
+  std::exception_ptr m_close_error {}; // of the retired files
+  std::deque<std::unique_ptr<OutputFile>> m_retired {};
+  bool m_stop = false;
+  std::thread m_thread; // last, it uses all the other members
+};
+
+// Output directories from a comma separated list, as given on the command line or in AcqConfig.conf
+inline std::vector<std::string> split_directories(std::string_view list)
+{
+  std::vector<std::string> directories {};
+  while (!list.empty()) {
+    const auto end = std::min(list.find(','), list.size());
+    auto directory = list.substr(0, end);
+    while (!directory.empty() && directory.front() == ' ') {
+      directory.remove_prefix(1);
+    }
+    while (!directory.empty() && directory.back() == ' ') {
+      directory.remove_suffix(1);
+    }
+    if (!directory.empty()) {
+      directories.emplace_back(directory);
+    }
+    list.remove_prefix(std::min(end + 1, list.size()));
+  }
+  return directories;
+}
+
+// Byte range of a file holding whole records, a striped output is the concatenation of its stripes
+struct Stripe {
+  std::string file;
+  size_t offset = 0;
+  size_t size = 0;
+};
+
+// Output files rotated at max_file_size, optionally striped over several directories, usually on different disks
+// With several targets the stream is cut in stripes of whole records written round robin to one file per target.
+// Each target has its own files and I/O thread, so the disks write in parallel: striping needs a block backend,
+// and each target queues a whole stripe while the others write theirs.
+// The manifest lists the stripes in stream order, one "offset size file" line each.
+class StripedOutput {
+  public:
+  struct Config {
+    size_t max_file_size = size_t(2) << 30U; // bytes, the file is rotated once it is exceeded
+    // Bytes written to a target before moving to the next one
+    // With several targets, each one holds (stripe_size / block_size + 1) blocks, 72 MiB with the defaults
+    size_t stripe_size = 64U << 20U;
+    OutputFile::Config file {};
+    // Write indexed raw files of this record type, see raw_file.hpp
+    std::optional<raw_file::RecordType> indexed {};
+    size_t index_block_size = 4U << 20U;
+  };
+
+  // next_name(target) gives the name of the next file of a target, the manifest is only written with several targets
+  // It is called from the background threads of the targets, concurrently
+  // Throws OutputFileError::Open when striping with the stream backend, which writes from the calling thread
+  StripedOutput(size_t targets, const std::function<std::string(size_t)>& next_name, const std::string& manifest_name,
+      const Config& config, std::function<void(const OutputFile&)> on_open = {})
+      : m_config(config)
+      , m_on_open(std::move(on_open))
+  {
+    // Like the data files, an existing manifest is never overwritten
+    if (targets > 1 && std::filesystem::exists(manifest_name)) {
+      throw OutputFileError(OutputFileError::Exists, "File \"" + manifest_name + "\" exists");
+    }
+    if (targets > 1 && m_config.file.backend == WriterBackend::Stream) {
+      throw OutputFileError(OutputFileError::Open, "Striping over several directories needs the block or io_uring writer");
+    }
+    auto file_config = m_config.file;
+    file_config.preallocate = m_config.max_file_size;
+    if (targets > 1) {
+      // The blocks of a whole stripe, plus the one being filled when the stripe ends
+      auto& blocks = file_config.block_writer;
+      blocks.block_count = std::max(blocks.block_count, (m_config.stripe_size + blocks.block_size - 1) / blocks.block_size + 1);
+    }
+    for (size_t target = 0; target < std::max<size_t>(targets, 1); ++target) {
+      m_targets.push_back(Target {std::make_unique<FileRotator>([=] { return next_name(target); }, file_config), {}, {}});
+    }
+    rotate(); // report the errors right away, before the manifest is created
+    if (m_targets.size() > 1) {
+      m_manifest.open(manifest_name, std::ios::out);
+      if (!m_manifest) {
+        throw OutputFileError(OutputFileError::Open, "Unable to create " + manifest_name);
+      }
+      m_manifest << "# sampasrs stripe manifest v1: offset size file\n";
+    }
+  }
+
+  StripedOutput(const StripedOutput&) = delete;
+  StripedOutput& operator=(const StripedOutput&) = delete;
+
+  ~StripedOutput()
+  {
+    try {
+      close();
+    } catch (const std::runtime_error&) {
+      // Destructors can't report errors, call close() to see them
+    }
+  }
+
+  // Write one record, with the write(Output&) of Payload and Event, the stripes only end between records
+  // Throws OutputFileError
+  template <typename Record>
+  void write(const Record& record)
+  {
+    auto& target = m_targets[m_target];
+    if (!target.file || target.file->size() > m_config.max_file_size) {
+      rotate();
+    }
+
+    const auto begin = target.file->size();
+    record.write(*target.file);
+    if (target.index) {
+      target.index->add(raw_file::record_info(record), begin, target.file->size());
+    }
+    if (m_targets.size() > 1 && target.file->size() - m_stripe_start >= m_config.stripe_size) {
+      end_stripe();
+      m_target = (m_target + 1) % m_targets.size();
+      const auto& next = m_targets[m_target].file;
+      m_stripe_start = next ? next->size() : 0;
+    }
+  }
+
+  // Throws the errors found while closing the full files in the background
+  void check_errors()
+  {
+    for (auto& target : m_targets) {
+      target.rotator->check_errors();
+    }
+  }
+
+  // Close the current files and wait for the ones still being closed in the background
+  // Throws the first OutputFileError, after closing everything
+  void close()
+  {
+    std::exception_ptr error {};
+    end_stripe();
+    for (auto& target : m_targets) {
+      try {
+        if (target.file) {
+          finish_file(target);
+          auto file = std::move(target.file);
+          file->close();
+        }
+      } catch (const OutputFileError&) {
+        error = error ? error : std::current_exception();
+      }
+      try {
+        target.rotator->close();
+      } catch (const OutputFileError&) {
+        error = error ? error : std::current_exception();
+      }
+    }
+    if (m_manifest.is_open()) {
+      m_manifest.close();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  private:
+  struct Target {
+    std::unique_ptr<FileRotator> rotator;
+    std::unique_ptr<OutputFile> file;
+    std::optional<raw_file::IndexBuilder> index; // of the current file
+  };
+
+  // Next file of the current target
+  void rotate()
+  {
+    auto& target = m_targets[m_target];
+    end_stripe();
+    finish_file(target);
+    target.rotator->retire(std::move(target.file));
+    target.file = target.rotator->next();
+    target.file->start(); // the prepared files hold no buffers
+    if (m_config.indexed) {
+      target.index.emplace(*m_config.indexed, m_config.index_block_size);
+      target.index->write_header(*target.file);
+    }
+    m_stripe_start = target.file->size(); // the stripes only hold records
+    if (m_on_open) {
+      m_on_open(*target.file);
+    }
+  }
+
+  // The index goes after the last record of an indexed file
+  static void finish_file(Target& target)
+  {
+    if (target.file && target.index) {
+      target.index->write_footer(*target.file, target.file->size());
+      target.index.reset();
+    }
+  }
+
+  void end_stripe()
+  {
+    const auto& file = m_targets[m_target].file;
+    if (!m_manifest.is_open() || !file || file->size() == m_stripe_start) {
+      return;
+    }
+    const auto path = std::filesystem::absolute(file->name()).string();
+    m_manifest << m_stripe_start << " " << file->size() - m_stripe_start << " " << path << "\n";
+    m_manifest.flush();
+    m_stripe_start = file->size();
+  }
+
+  Config m_config {};
+  std::function<void(const OutputFile&)> m_on_open;
+  std::vector<Target> m_targets {};
+  size_t m_target = 0;       // receiving the current stripe
+  size_t m_stripe_start = 0; // offset of the current stripe in the target file
+  std::ofstream m_manifest {};
+};
+
+// Stripes of a manifest written by StripedOutput, the files moved next to the manifest are found too
+inline std::vector<Stripe> read_stripe_manifest(const std::string& manifest_name)
+{
+  std::ifstream manifest(manifest_name);
+  if (!manifest) {
+    throw std::runtime_error("Unable to open " + manifest_name);
+  }
+
+  const auto directory = std::filesystem::path(manifest_name).parent_path();
+  std::vector<Stripe> stripes {};
+  std::string line {};
+  while (std::getline(manifest, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    Stripe stripe {};
+    std::istringstream fields(line);
+    if (!(fields >> stripe.offset >> stripe.size) || !std::getline(fields >> std::ws, stripe.file)) {
+      throw std::runtime_error("Invalid manifest line: " + line);
+    }
+    if (!std::filesystem::exists(stripe.file)) {
+      const auto moved = directory / std::filesystem::path(stripe.file).filename();
+      if (std::filesystem::exists(moved)) {
+        stripe.file = moved.string();
+      }
+    }
+    stripes.push_back(std::move(stripe));
+  }
+  return stripes;
+}
+
+} // namespace sampasrs
@@ -3,6 +3,7 @@
 #include <fmt/format.h>
 
 #include <chrono>
+#include <iostream>
 #include <string>
 #include <thread>
 
@@ -18,14 +19,52 @@ int main(int argc, const char* argv[])
     address = argv[2];
   }
 
+  sampasrs::Acquisition::Config config {};
+  if (argc > 3) {
+    // Capture mode: sniffer, mmap or socket
+    const auto capture = sampasrs::capture_mode_from_string(argv[3]);
+    if (!capture) {
+      std::cerr << "Unknown capture mode: " << argv[3] << "\n";
+      return 1;
+    }
+    config.capture = *capture;
+  }
+  if (argc > 4) {
+    // Decoder threads, the FECs are split between them
+    config.decoder_threads = std::stoul(argv[4]);
+  }
+  if (argc > 5) {
+    // Writer backend: stream, block or io_uring
+    const auto writer = sampasrs::writer_backend_from_string(argv[5]);
+    if (!writer) {
+      std::cerr << "Unknown writer: " << argv[5] << "\n";
+      return 1;
+    }
+    config.writer = *writer;
+  }
+  if (argc > 6) {
+    // Comma separated output directories, the raw data is striped over them
+    config.output_directories = sampasrs::split_directories(argv[6]);
+    if (config.output_directories.size() > 1 && config.writer == sampasrs::WriterBackend::Stream) {
+      std::cerr << "Several output directories need the block or io_uring writer\n";
+      return 1;
+    }
+  }
+  if (argc > 7) {
+    // 1 to write indexed raw files, .iraw
+    config.indexed_files = std::stoi(argv[7]) != 0;
+  }
+
   const bool save_raw = true;
-  sampasrs::Acquisition sampa(file_prefix, save_raw, {}, address); // Start aquisition
+  sampasrs::Acquisition sampa(file_prefix, save_raw, {}, address, config); // Start aquisition
 
   // Loop forever
   while (true) {
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
     const auto stats = sampa.get_stats();
-    fmt::print("Events recorded: {} | Events/s {:5.2f} | Invalid events {:5.2f} % | Buffer usage: {:5.2f} % | Net speed: {:5.2f} MB/s | Write speed {:5.2f} MB/s\n",
-        stats.valid_events, stats.valid_event_rate, stats.invalid_event_ratio, stats.write_buffer_use, stats.read_speed, stats.write_speed);
+    fmt::print("Events recorded: {} | Events/s {:5.2f} | Invalid events {:5.2f} % | Buffer usage: {:5.2f} % | Net speed: {:5.2f} MB/s | Write speed {:5.2f} MB/s | Dropped packets {} payloads {} events {} | Buffer allocations {} | Event reuse {:5.2f} % | Evicted events {} | Event memory {:5.2f} MB\n",
+        stats.valid_events, stats.valid_event_rate, stats.invalid_event_ratio, stats.write_buffer_use, stats.read_speed, stats.write_speed,
+        stats.dropped_packets, stats.dropped_payloads, stats.dropped_events, stats.payload_allocations, stats.event_pool_hit_rate,
+        stats.evicted_events, stats.event_memory);
   }
 }
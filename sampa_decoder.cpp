@@ -1,11 +1,24 @@
 #include <sampasrs/root_fix.hpp>
 
 #include <sampasrs/decoder.hpp>
+#include <sampasrs/event_builder.hpp>
 #include <sampasrs/mapping.hpp>
+#include <sampasrs/parallel_decoder.hpp>
+#include <sampasrs/raw_file.hpp>
+#include <sampasrs/writer.hpp>
 
 #include <TFile.h>
+#include <TROOT.h>
 #include <TTree.h>
 #include <TEnv.h>
+#include <ROOT/TBufferMerger.hxx>
+
+#ifdef WITH_RNTUPLE
+#include <ROOT/REntry.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#endif
 
 #ifdef WITH_LIBPCAP
 #include <tins/tins.h>
@@ -13,9 +26,13 @@
 
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -30,62 +47,84 @@ ConfigVars::ConfigVars(const char* conffile)
   TEnv env(conffile);
   mapfpath.assign(env.GetValue("mapping",""));
   minsampa = env.GetValue("first_sampa",0);
-  
+  build_events = env.GetValue("build_events", 0) != 0;
+  rntuple = std::string(env.GetValue("root_format", "tree")) == "rntuple";
+  flat_layout = std::string(env.GetValue("root_layout", "nested")) == "flat";
+
+  // Same numbers as ROOT::CompressionSettings, without a level the one recommended by ROOT
+  const std::unordered_map<std::string, std::pair<int, int>> algorithms {
+      {"zlib", {1, 1}}, {"lzma", {2, 7}}, {"lz4", {4, 4}}, {"zstd", {5, 5}}};
+  const std::string algorithm = env.GetValue("root_compression", "");
+  const int level = env.GetValue("root_compression_level", 0);
+  compression = -1;
+  if (const auto found = algorithms.find(algorithm); found != algorithms.end()) {
+    compression = 100 * found->second.first + (level > 0 ? std::min(level, 9) : found->second.second);
+  } else if (!algorithm.empty()) {
+    std::cerr << "Unknown root_compression " << algorithm << ", using the default of ROOT\n";
+  }
+  basket_size = env.GetValue("root_basket_size", 0);
+  auto_flush = env.GetValue("root_auto_flush", 0);
+  root_threads = env.GetValue("root_threads", 0);
 }
 
-int main(int argc, const char* argv[])
-{
+using StripMap = std::unordered_map<int, std::pair<double, double>>;
 
-  if (argc < 2) {
-    std::cerr << "Usage: sampa_decoder <input files>\n";
-    return 1;
+// The decoded events in a ROOT file, one entry per valid event, in a TTree or an RNTuple
+class RootWriter {
+  public:
+  RootWriter(const std::string& file_name, const ConfigVars& conf, const StripMap& map_of_strips)
+      : RootWriter(std::make_shared<TFile>(file_name.c_str(), "recreate"), conf, map_of_strips)
+  {
   }
-  const char* input_name = argv[1];
 
-  auto input_path = std::filesystem::path(input_name);
-  const auto rootfname = input_path.replace_extension(".root").string();
-
-  std::cout << "generating root file: " << rootfname << "\n";
-  TFile out_file(rootfname.c_str(), "recreate");
-  TTree tree("waveform", "Waveform");
-
-  // mapping pair creation
-  std::unordered_map<int, std::pair<double, double>> map_of_strips = {};
-
-  ConfigVars conf("../AcqConfig.conf");
-  std::cout << "Conf. file successfuly read." << std::endl;
-  std::cout << "Map file: " << conf.mapfpath << std::endl;
-  std::cout << "MinSampa: " << conf.minsampa << std::endl;
-  
-  Mapping_strips(map_of_strips,conf.mapfpath.c_str()); 
-  std::cout <<conf.mapfpath.c_str()<<std::endl;
+  // Into a file made elsewhere, e.g. by a TBufferMerger, write() merges it into the output then
+  RootWriter(std::shared_ptr<TFile> file, const ConfigVars& conf, const StripMap& map_of_strips)
+      : m_file(std::move(file))
+      , m_conf(conf)
+      , m_map_of_strips(map_of_strips)
+      , m_flat(conf.flat_layout && !conf.rntuple)
+  {
+    // The branches take the compression of the file when they are made
+    if (m_conf.compression >= 0) {
+      m_file->SetCompressionSettings(m_conf.compression);
+    }
+    if (m_conf.rntuple) {
+      make_ntuple();
+      return;
+    }
 
-  // Tree branches
-  uint32_t bx_count {};
-  uint8_t fec_id {};
-  long timestamp {};
-  std::vector<short> channel {};
-  std::vector<short> sampa {};
-  std::vector<int> glchn {};
-  std::vector<double> x {};
-  std::vector<double> y {};
-  std::vector<std::vector<short>> words {};
-
-  tree.Branch("bx_count", &bx_count, "bx_counter/i");
-  tree.Branch("fec_id", &fec_id, "fec_id/b");
-  tree.Branch("timestamp", &timestamp, "timestamp/L");
-  tree.Branch("channel", &channel);
-  tree.Branch("sampa", &sampa);
-  tree.Branch("glchn", &glchn);
-  tree.Branch("x", &x);
-  tree.Branch("y", &y);
-  tree.Branch("words", &words);
+    m_tree = std::make_unique<TTree>("waveform", "Waveform");
+    m_tree->SetDirectory(m_file.get());
+    m_tree->Branch("bx_count", &m_bx_count, "bx_counter/i");
+    m_tree->Branch("fec_id", &m_fec_id, "fec_id/b");
+    m_tree->Branch("timestamp", &m_timestamp, "timestamp/L");
+    m_tree->Branch("fec", &m_fec);
+    m_tree->Branch("channel", &m_channel);
+    m_tree->Branch("sampa", &m_sampa);
+    m_tree->Branch("glchn", &m_glchn);
+    if (m_flat) {
+      // The samples of waveform i are samples[offset[i]] to samples[offset[i] + length[i] - 1]
+      m_tree->Branch("x", &m_x_float);
+      m_tree->Branch("y", &m_y_float);
+      m_tree->Branch("samples", &m_decoded.samples);
+      m_tree->Branch("offset", &m_decoded.sample_offset);
+      m_tree->Branch("length", &m_decoded.sample_count);
+    } else {
+      m_tree->Branch("x", &m_x);
+      m_tree->Branch("y", &m_y);
+      m_tree->Branch("words", &m_words);
+    }
 
-  size_t n_events = 0;
-  size_t n_valid_events = 0;
-  size_t output_bytes = 0;
+    if (m_conf.basket_size > 0) {
+      m_tree->SetBasketSize("*", m_conf.basket_size);
+    }
+    if (m_conf.auto_flush != 0) {
+      m_tree->SetAutoFlush(m_conf.auto_flush);
+    }
+  }
 
-  auto save_event = [&](Event&& event) {
+  void save(Event&& event)
+  {
     ++n_events;
     if (!event.valid()) {
       return;
@@ -93,28 +132,57 @@ int main(int argc, const char* argv[])
     ++n_valid_events;
     output_bytes += event.hits.size() * sizeof(Hit);
 
-    fec_id = event.fec_id;
-    timestamp = event.timestamp;
-    bx_count = event.bx_count;
+    m_decoded.assign(event);
+    m_fec_id = m_decoded.fec_id;
+    m_timestamp = m_decoded.timestamp;
+    m_bx_count = m_decoded.bx_count;
 
-    for (size_t waveform = 0; waveform < event.waveform_count(); ++waveform) {
-      const auto header = event.get_header(waveform);
-      channel.push_back((int)header.channel_addr());
-      sampa.push_back((int)header.sampa_addr());
-      glchn.push_back(32 * ((int)header.sampa_addr() - conf.minsampa) + (int)header.channel_addr());
-      x.push_back(map_of_strips[32 * ((int)header.sampa_addr() - conf.minsampa) + (int)header.channel_addr()].first);  // only works using sampa from 8 to 11
-      y.push_back(map_of_strips[32 * ((int)header.sampa_addr() - conf.minsampa) + (int)header.channel_addr()].second); // only works using sampa from 8 to 11
-      words.push_back(event.copy_waveform(waveform));
+    // The word vectors are kept between events so copying doesn't allocate
+    // The flat layout writes the samples of m_decoded as they are
+    if (!m_flat) {
+      m_words.resize(m_decoded.waveform_count());
+    }
+    for (size_t waveform = 0; waveform < m_decoded.waveform_count(); ++waveform) {
+      const int sampa_addr = m_decoded.channel[waveform] / 32;
+      const int channel_addr = m_decoded.channel[waveform] % 32;
+      const int strip = 32 * (sampa_addr - m_conf.minsampa) + channel_addr;
+      // Shared by the threads, so it is only read, unknown strips are at 0, 0
+      const auto position = m_map_of_strips.find(strip);
+      const auto xy = position != m_map_of_strips.end() ? position->second : std::pair<double, double> {};
+      m_fec.push_back(m_decoded.fec[waveform]);
+      m_channel.push_back(channel_addr);
+      m_sampa.push_back(sampa_addr);
+      m_glchn.push_back(strip);
+      if (m_flat || m_conf.rntuple) {
+        m_x_float.push_back(static_cast<float>(xy.first));
+        m_y_float.push_back(static_cast<float>(xy.second));
+      } else {
+        m_x.push_back(xy.first);  // only works using sampa from 8 to 11
+        m_y.push_back(xy.second); // only works using sampa from 8 to 11
+      }
+      if (!m_flat) {
+        const auto* samples = m_decoded.waveform(waveform);
+        m_words[waveform].assign(samples, samples + m_decoded.sample_count[waveform]);
+      }
     }
 
     if(n_events%10000==0) std::cout << n_events << std::endl;
-    tree.Fill();
-    channel.clear();
-    sampa.clear();
-    glchn.clear();
-    x.clear();
-    y.clear();
-    words.clear();
+    if (m_tree) {
+      m_tree->Fill();
+    }
+#ifdef WITH_RNTUPLE
+    if (m_ntuple) {
+      m_ntuple->Fill(*m_entry);
+    }
+#endif
+    m_fec.clear();
+    m_channel.clear();
+    m_sampa.clear();
+    m_glchn.clear();
+    m_x.clear();
+    m_y.clear();
+    m_x_float.clear();
+    m_y_float.clear();
 
     // Print events info
     // fmt::print("Bx_count {:7d} - Channels {:3d}\n", event.bx_count,
@@ -124,47 +192,423 @@ int main(int argc, const char* argv[])
     // for (auto hit : event.hits) {
     //   std::cout << hit.to_string() << "\n";
     // }
+  }
+
+  void write()
+  {
+#ifdef WITH_RNTUPLE
+    // The RNTuple is committed into the file when its writer is destroyed
+    m_entry.reset();
+    m_ntuple.reset();
+#endif
+    m_file->Write();
+  }
+
+  size_t n_events = 0;
+  size_t n_valid_events = 0;
+  size_t output_bytes = 0;
+
+  private:
+  // The same columns as the nested tree, with float positions
+  // The samples of each waveform are a collection, RNTuple already stores them as one array with offsets
+  void make_ntuple()
+  {
+#ifdef WITH_RNTUPLE
+    auto model = ROOT::RNTupleModel::Create();
+    model->MakeField<std::uint32_t>("bx_count");
+    model->MakeField<std::uint8_t>("fec_id");
+    model->MakeField<std::int64_t>("timestamp");
+    model->MakeField<std::vector<short>>("fec");
+    model->MakeField<std::vector<short>>("channel");
+    model->MakeField<std::vector<short>>("sampa");
+    model->MakeField<std::vector<int>>("glchn");
+    model->MakeField<std::vector<float>>("x");
+    model->MakeField<std::vector<float>>("y");
+    model->MakeField<std::vector<std::vector<short>>>("samples");
+
+    // Pages are compressed by ROOT's threads with implicit multithreading
+    ROOT::RNTupleWriteOptions options {};
+    if (m_conf.compression >= 0) {
+      options.SetCompression(m_conf.compression);
+    }
+    if (m_conf.basket_size > 0) {
+      options.SetMaxUnzippedPageSize(static_cast<size_t>(m_conf.basket_size));
+    }
+    if (m_conf.auto_flush < 0) {
+      options.SetApproxZippedClusterSize(static_cast<size_t>(-static_cast<long>(m_conf.auto_flush)));
+    }
+    m_ntuple = ROOT::RNTupleWriter::Append(std::move(model), "waveform", *m_file, options);
+
+    // The fields are read from the same members as the branches
+    m_entry = m_ntuple->CreateEntry();
+    m_entry->BindRawPtr("bx_count", &m_bx_count);
+    m_entry->BindRawPtr("fec_id", &m_fec_id);
+    m_entry->BindRawPtr("timestamp", &m_timestamp);
+    m_entry->BindRawPtr("fec", &m_fec);
+    m_entry->BindRawPtr("channel", &m_channel);
+    m_entry->BindRawPtr("sampa", &m_sampa);
+    m_entry->BindRawPtr("glchn", &m_glchn);
+    m_entry->BindRawPtr("x", &m_x_float);
+    m_entry->BindRawPtr("y", &m_y_float);
+    m_entry->BindRawPtr("samples", &m_words);
+#else
+    throw std::runtime_error("RNTuple output needs ROOT 6.36 or newer");
+#endif
+  }
+
+  std::shared_ptr<TFile> m_file;
+  std::unique_ptr<TTree> m_tree {};
+#ifdef WITH_RNTUPLE
+  std::unique_ptr<ROOT::RNTupleWriter> m_ntuple {};
+  std::unique_ptr<ROOT::REntry> m_entry {};
+#endif
+  const ConfigVars& m_conf;
+  const StripMap& m_map_of_strips;
+  bool m_flat; // flat tree layout
+  ColumnarEvent m_decoded {}; // reused, the columns keep their memory between events
+
+  // Tree branches and RNTuple fields
+  uint32_t m_bx_count {};
+  uint8_t m_fec_id {};
+  std::int64_t m_timestamp {};
+  std::vector<short> m_fec {};
+  std::vector<short> m_channel {};
+  std::vector<short> m_sampa {};
+  std::vector<int> m_glchn {};
+  std::vector<double> m_x {};
+  std::vector<double> m_y {};
+  std::vector<float> m_x_float {}; // flat layout and RNTuple
+  std::vector<float> m_y_float {};
+  std::vector<std::vector<short>> m_words {};
+};
+
+// The records of a raw file in stream order: the blocks of an indexed file, or the whole file
+std::vector<ByteView> record_ranges(const std::filesystem::path& file_name, const raw_file::MappedFile& file)
+{
+  const auto extension = file_name.extension();
+  if (extension != ".iraw" && extension != ".irawev") {
+    return {ByteView(file.data(), file.size())};
+  }
+  std::vector<ByteView> ranges {};
+  for (const auto& block : raw_file::Reader(file_name.string()).blocks()) {
+    const auto offset = std::min<size_t>(block.offset, file.size());
+    ranges.emplace_back(file.data() + offset, file.input(offset, block.size).remaining());
+  }
+  return ranges;
+}
+
+// Each file of a run is decoded by a thread into its own ROOT file, with the events of a serial decoding
+// A single raw file is split into chunks instead, decoded by the threads and saved in order into one ROOT file:
+// the threads fill the tree of each chunk in memory, compressing its baskets, and the chunks are merged in order.
+// An RNTuple is compressed by ROOT's threads instead, the chunks keep their events until they are saved in order.
+// The events spanning two files or chunks are handed over as the SegmentedDecoder explains
+int decode_in_parallel(const std::vector<std::filesystem::path>& input_files, size_t threads,
+    const ConfigVars& conf, const StripMap& map_of_strips)
+{
+  // Bytes of payloads in a chunk, the warm up of each chunk is read twice
+  constexpr size_t chunk_size = 32U << 20U;
+
+  std::vector<std::unique_ptr<raw_file::MappedFile>> files {};
+  std::vector<SegmentedDecoder::Segment> segments {};
+  std::optional<raw_file::RecordType> record_type {};
+  for (const auto& file_name : input_files) {
+    const auto extension = file_name.extension();
+    if (extension != ".raw" && extension != ".rawev" && extension != ".iraw" && extension != ".irawev") {
+      std::cerr << "Only raw files are decoded in parallel: " << file_name << "\n";
+      return 1;
+    }
+    const auto type = extension == ".rawev" || extension == ".irawev" ? raw_file::RecordType::Event : raw_file::RecordType::Payload;
+    if (record_type && *record_type != type) {
+      std::cerr << "Raw and raw events files can't be decoded together\n";
+      return 1;
+    }
+    record_type = type;
+
+    try {
+      files.push_back(std::make_unique<raw_file::MappedFile>(file_name.string()));
+      SegmentedDecoder::Segment segment {};
+      segment.records = record_ranges(file_name, *files.back());
+      if (!segments.empty() && type == raw_file::RecordType::Payload) {
+        segment.warm_up = payload_tail(segments.back().records, SegmentedDecoder::default_warm_up);
+      }
+      segments.push_back(std::move(segment));
+    } catch (const std::runtime_error& error) {
+      std::cerr << error.what() << "\n";
+      return 1;
+    }
+  }
+
+  // The events of .rawev files are only read, not worth splitting
+  const bool chunked = segments.size() == 1 && *record_type == raw_file::RecordType::Payload;
+  if (chunked) {
+    auto chunks = split_payloads(segments.front().records, chunk_size);
+    segments.clear();
+    for (auto& records : chunks) {
+      SegmentedDecoder::Segment segment {};
+      segment.records = std::move(records);
+      if (!segments.empty()) {
+        segment.warm_up = payload_tail(segments.back().records, SegmentedDecoder::default_warm_up);
+      }
+      segments.push_back(std::move(segment));
+    }
+  }
+
+  for (const auto& file_name : input_files) {
+    std::cout << "Decoding " << file_name << " into " << std::filesystem::path(file_name).replace_extension(".root") << "\n";
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Each worker makes and fills the ROOT file of its file or chunk, finish() writes it
+  ROOT::EnableThreadSafety();
+  const auto chunks_root_name = std::filesystem::path(input_files.front()).replace_extension(".root").string();
+  std::unique_ptr<ROOT::TBufferMerger> merger {};
+  std::unique_ptr<RootWriter> ntuple_output {};
+  std::vector<std::vector<Event>> chunk_events(chunked && conf.rntuple ? segments.size() : 0);
+  if (chunked && conf.rntuple) {
+    ntuple_output = std::make_unique<RootWriter>(chunks_root_name, conf, map_of_strips);
+  } else if (chunked) {
+    merger = std::make_unique<ROOT::TBufferMerger>(chunks_root_name.c_str(), "recreate",
+        conf.compression >= 0 ? conf.compression : ROOT::RCompressionSetting::EDefaults::kUseCompiledDefault);
+  }
+  std::vector<std::unique_ptr<RootWriter>> outputs(segments.size()); // after the merger, they are destroyed first
+
+  size_t n_events = 0;
+  size_t n_valid_events = 0;
+  size_t output_bytes = 0;
+  auto count = [&](const RootWriter& output) {
+    n_events += output.n_events;
+    n_valid_events += output.n_valid_events;
+    output_bytes += output.output_bytes;
+  };
+
+  auto open_output = [&](size_t segment) {
+    if (ntuple_output) {
+      chunk_events[segment].clear(); // when decoded again
+      return SegmentedDecoder::Sink([events = &chunk_events[segment]](Event&& event) { events->push_back(std::move(event)); });
+    }
+    // When decoded again, the previous file is dropped: made again, or never merged
+    outputs[segment].reset();
+    if (merger) {
+      outputs[segment] = std::make_unique<RootWriter>(merger->GetFile(), conf, map_of_strips);
+    } else {
+      const auto root_name = std::filesystem::path(input_files[segment]).replace_extension(".root").string();
+      outputs[segment] = std::make_unique<RootWriter>(root_name, conf, map_of_strips);
+    }
+    return SegmentedDecoder::Sink([output = outputs[segment].get()](Event&& event) { output->save(std::move(event)); });
   };
+  auto finish = [&](size_t segment) {
+    if (ntuple_output) {
+      for (auto& event : chunk_events[segment]) {
+        ntuple_output->save(std::move(event));
+      }
+      chunk_events[segment] = {}; // frees the memory
+      return;
+    }
+    // A chunk is merged into the ROOT file, after the previous ones
+    outputs[segment]->write();
+    count(*outputs[segment]);
+    outputs[segment].reset();
+  };
+
+  SegmentedDecoder decoder(*record_type);
+  const auto result = decoder.decode(segments, threads, open_output, finish);
+  if (ntuple_output) {
+    ntuple_output->write();
+    count(*ntuple_output);
+  }
+  merger.reset(); // closes the ROOT file of the chunks
+
+  auto duration = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+  if (result.redone_segments > 0) {
+    std::cout << result.redone_segments << (chunked ? " chunks" : " files")
+              << " decoded again, some events stayed open for longer than the warm up\n";
+  }
+  const auto ibytes = static_cast<float>(result.input_bytes);
+  const auto obytes = static_cast<float>(output_bytes);
+  std::cout << "Duration " << duration << " ms\n";
+  std::cout << (ibytes / 1024.f / 1024.f) / duration * 1000 << " MB/s\n";
+  std::cout << "Input size  " << ibytes / 1024.f / 1024.f << " MB\n";
+  std::cout << "Output size " << obytes / 1024.f / 1024.f << " MB\n";
+  std::cout << "Valid events " << n_valid_events << "\n";
+  std::cout << "Total events " << n_events << "\n";
+  if (!chunked) {
+    std::cout << "The trees can be read together with TChain(\"waveform\") or merged with hadd\n";
+  }
+  return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+  // Decode the files of a run on this many threads, into one ROOT file each, or the chunks of a single file
+  size_t threads = 1;
+  int first_input = 1;
+  if (argc > 2 && std::string(argv[1]) == "-j") {
+    threads = std::max(std::stoul(argv[2]), 1UL);
+    first_input = 3;
+  }
+
+  if (argc <= first_input) {
+    std::cerr << "Usage: sampa_decoder [-j threads] <input files>\n";
+    return 1;
+  }
+
+  // mapping pair creation
+  StripMap map_of_strips = {};
+
+  ConfigVars conf("../AcqConfig.conf");
+  std::cout << "Conf. file successfuly read." << std::endl;
+  std::cout << "Map file: " << conf.mapfpath << std::endl;
+  std::cout << "MinSampa: " << conf.minsampa << std::endl;
+  std::cout << "Build events: " << conf.build_events << std::endl;
+  
+  Mapping_strips(map_of_strips,conf.mapfpath.c_str()); 
+  std::cout <<conf.mapfpath.c_str()<<std::endl;
+
+#ifndef WITH_RNTUPLE
+  if (conf.rntuple) {
+    std::cerr << "RNTuple output needs ROOT 6.36 or newer\n";
+    return 1;
+  }
+#endif
 
-  EventAssembler sorter(save_event);
-  sorter.process_invalid_events = true;
-  sorter.enable_remove_caca = true;
-  sorter.enable_header_fix = false;
+  // The baskets of the branches, or the pages of the RNTuple, are compressed in parallel by ROOT's threads
+  if (conf.root_threads > 0) {
+    ROOT::EnableImplicitMT(conf.root_threads);
+  }
+
+  if (threads > 1) {
+    if (conf.build_events) {
+      // The event builder state depends on where it started, it can't be rebuilt at the start of each file
+      std::cout << "Events built from several FECs are decoded with one thread\n";
+    } else {
+      return decode_in_parallel({argv + first_input, argv + argc}, threads, conf, map_of_strips);
+    }
+  }
+
+  const char* input_name = argv[first_input];
+  auto input_path = std::filesystem::path(input_name);
+  const auto rootfname = input_path.replace_extension(".root").string();
+
+  std::cout << "generating root file: " << rootfname << "\n";
+  RootWriter output(rootfname, conf, map_of_strips);
+  auto save_event = [&](Event&& event) { output.save(std::move(event)); };
+
+  // Each FEC has its own assembler, their events are optionally merged by bx_count
+  std::optional<EventBuilder> builder {};
+  if (conf.build_events) {
+    builder.emplace(save_event);
+  }
+  auto next_stage = [&](Event&& event) {
+    if (builder) {
+      builder->add(std::move(event));
+    } else {
+      save_event(std::move(event));
+    }
+  };
+  auto assembler = make_event_assembler(next_stage);
+  assembler.process_invalid_events = true;
+  assembler.enable_remove_caca = true;
+  assembler.enable_header_fix = false;
+  BasicStreamAssembler sorter(assembler);
 
   size_t input_bytes = 0;
   auto start = std::chrono::high_resolution_clock::now();
 
-  for (int i = 1; i < argc; ++i) {
+  // The raw files are mapped and read in place, the payloads are decoded without copying them
+  Event event {}; // reused, save_event doesn't keep it
+  auto read_records = [&](MemoryInput input, bool raw_events) {
+    while (!input.eof()) {
+      if (raw_events) {
+        Event::read(input, event);
+        if (!input) {
+          break;
+        }
+        input_bytes += event.byte_size();
+        next_stage(std::move(event));
+      } else {
+        auto payload = PayloadView::read(input);
+        if (!input) {
+          break;
+        }
+        input_bytes += payload.byte_size();
+        sorter.process(payload);
+      }
+    }
+    if (!input) {
+      std::cerr << "Truncated record, the rest of the file is skipped\n";
+    }
+  };
+
+  std::optional<raw_file::MappedFile> mapped_file {};
+  auto map_file = [&](const std::string& name) {
+    try {
+      mapped_file.emplace(name);
+    } catch (const std::runtime_error& error) {
+      std::cerr << error.what() << "\n";
+      return false;
+    }
+    return true;
+  };
+
+  for (int i = first_input; i < argc; ++i) {
     const auto file_name = std::filesystem::path(argv[i]);
     const auto file_extension = file_name.extension().string();
 
     std::cout << "Reading file: " << file_name;
-    if (file_extension == ".raw") {
-      std::cout << " as raw file\n";
-      std::ifstream input_file(file_name.c_str(), std::ios::binary);
-      if (!input_file) {
-        std::cerr << "Unable to open file\n";
+    if (file_extension == ".raw" || file_extension == ".rawev") {
+      const bool raw_events = file_extension == ".rawev";
+      std::cout << (raw_events ? " as raw events file\n" : " as raw file\n");
+      if (!map_file(file_name.string())) {
         return 1;
       }
-      int it=0;
-      while (!input_file.eof()) {
-	it++;
-        auto payload = Payload::read(input_file);
-        input_bytes += payload.byte_size();
-        sorter.process(payload);
+      read_records(mapped_file->input(), raw_events);
+    } else if (file_extension == ".iraw" || file_extension == ".irawev") {
+      std::cout << " as indexed raw file\n";
+      std::optional<raw_file::Reader> index {};
+      try {
+        index.emplace(file_name.string());
+      } catch (const std::runtime_error& error) {
+        std::cerr << error.what() << "\n";
+        return 1;
       }
-    } else if (file_extension == ".rawev") {
-      std::cout << " as raw events file\n";
-      std::ifstream input_file(file_name.c_str(), std::ios::binary);
-      if (!input_file) {
-        std::cerr << "Unable to open file\n";
+      if (!map_file(file_name.string())) {
         return 1;
       }
 
-      while (!input_file.eof()) {
-        auto event = Event::read(input_file);
-        input_bytes += event.byte_size();
-        save_event(std::move(event));
+      const bool raw_events = index->header().record_type == raw_file::RecordType::Event;
+      for (const auto& block : index->blocks()) {
+        read_records(mapped_file->input(block.offset, block.size), raw_events);
+      }
+    } else if (file_extension == ".manifest") {
+      // Raw or raw events files striped over several directories, read stripe by stripe in stream order
+      // The stripes of indexed files only cover their records
+      const auto striped_extension = file_name.stem().extension();
+      const bool raw_events = striped_extension == ".rawev" || striped_extension == ".irawev";
+      std::cout << (raw_events ? " as striped raw events files\n" : " as striped raw files\n");
+      const auto stripes = read_stripe_manifest(file_name.string());
+
+      // The stripes alternate between the files of the targets, each one stays mapped until its last stripe
+      std::unordered_map<std::string, size_t> last_stripe {};
+      for (size_t s = 0; s < stripes.size(); ++s) {
+        last_stripe[stripes[s].file] = s;
+      }
+      std::unordered_map<std::string, raw_file::MappedFile> stripe_files {};
+      for (size_t s = 0; s < stripes.size(); ++s) {
+        const auto& stripe = stripes[s];
+        auto file = stripe_files.find(stripe.file);
+        if (file == stripe_files.end()) {
+          try {
+            file = stripe_files.try_emplace(stripe.file, stripe.file).first;
+          } catch (const std::runtime_error& error) {
+            std::cerr << error.what() << "\n";
+            return 1;
+          }
+        }
+        read_records(file->second.input(stripe.offset, stripe.size), raw_events);
+        if (last_stripe[stripe.file] == s) {
+          stripe_files.erase(file);
+        }
       }
     } else {
 #ifdef WITH_LIBPCAP
@@ -185,16 +629,19 @@ int main(int argc, const char* argv[])
     }
   }
 
-  out_file.Write();
+  if (builder) {
+    builder->flush();
+  }
+  output.write();
 
   auto duration = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
 
   const auto ibytes = static_cast<float>(input_bytes);
-  const auto obytes = static_cast<float>(output_bytes);
+  const auto obytes = static_cast<float>(output.output_bytes);
   std::cout << "Duration " << duration << " ms\n";
   std::cout << (ibytes / 1024.f / 1024.f) / duration * 1000 << " MB/s\n";
   std::cout << "Input size  " << ibytes / 1024.f / 1024.f << " MB\n";
   std::cout << "Output size " << obytes / 1024.f / 1024.f << " MB\n";
-  std::cout << "Valid events " << n_valid_events << "\n";
-  std::cout << "Total events " << n_events << "\n";
+  std::cout << "Valid events " << output.n_valid_events << "\n";
+  std::cout << "Total events " << output.n_events << "\n";
 };
@@ -7,6 +7,7 @@
 #include "implot.h"
 #include "misc/cpp/imgui_stdlib.h"
 
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <memory>
@@ -64,13 +65,16 @@ class Graphs {
     int min_channel = std::numeric_limits<int>::max();
     int max_channel = 0;
 
-    for (size_t waveform = 0; waveform < event.waveform_count(); ++waveform) {
-      for (size_t word = 1; word < event.word_count(waveform); ++word) { //start from 1 since the word 0 this the number of words
-        const int channel = event.get_header(selected_waveform).global_channel();
+    m_event.assign(event);
+
+    for (size_t waveform = 0; waveform < m_event.waveform_count(); ++waveform) {
+      const auto* samples = m_event.waveform(waveform);
+      for (size_t word = 1; word < m_event.sample_count[waveform]; ++word) { //start from 1 since the word 0 this the number of words
+        const int channel = m_event.channel[selected_waveform];
         min_channel = std::min(min_channel, channel);
         max_channel = std::max(max_channel, channel + 1);
 
-        auto signal = event.get_word(waveform, word);
+        auto signal = samples[word];
         if (energy < signal) {
           selected_waveform = waveform;
           energy = signal;
@@ -80,8 +84,7 @@ class Graphs {
 
     // Update histograms
     if (energy > 0) {
-      const auto header = event.get_header(selected_waveform);
-      const int channel = header.global_channel();
+      const int channel = m_event.channel[selected_waveform];
 
       // Adjust number of channels in the histogram
       if (m_channel_hist.size() == 0) {
@@ -98,11 +101,9 @@ class Graphs {
       m_energy_hist(energy);
 
       if (m_waveform_timer) {
-        const auto size = std::min(static_cast<size_t>(header.word_count()), m_waveform.capacity()); // this min will prevent reallocations
+        const auto size = std::min(static_cast<size_t>(m_event.sample_count[selected_waveform]), m_waveform.capacity()); // this min will prevent reallocations
         m_waveform.resize(size);
-        for (size_t i = 0; i < size; ++i) {
-          m_waveform[i] = event.get_word(selected_waveform, i);
-        }
+        std::copy_n(m_event.waveform(selected_waveform), size, m_waveform.begin());
       }
     }
   }
@@ -112,6 +113,7 @@ class Graphs {
   Hist m_energy_hist {boost::histogram::make_histogram(HistAxis(0, 1024))};
   Hist m_channel_hist {};
   std::vector<short> m_waveform {};
+  ColumnarEvent m_event {}; // current event, decoded
   std::mutex m_channel_lock;
 };
 
@@ -175,6 +177,27 @@ class App {
     static constexpr bool process_events = true;
     //static const std::string fec_address = "10.0.0.2";
     static const std::string fec_address = env.GetValue("fec_address","");
+    static const std::string capture_name = env.GetValue("capture", "sniffer");
+    static const auto capture_mode = capture_mode_from_string(capture_name);
+    static const auto decoder_threads = static_cast<size_t>(std::max(env.GetValue("decoder_threads", 1), 1));
+    static const bool build_events = env.GetValue("build_events", 0) != 0;
+    static const std::string writer_name = env.GetValue("writer", "stream");
+    static const auto writer_backend = writer_backend_from_string(writer_name);
+    static const auto output_directories = split_directories(env.GetValue("output_directories", ""));
+    // Invalid settings in the config file, the acquisition can't start until they are fixed
+    static const std::string config_error = [] {
+      if (!capture_mode) {
+        return "Unknown capture mode in the config file: " + capture_name;
+      }
+      if (!writer_backend) {
+        return "Unknown writer in the config file: " + writer_name;
+      }
+      if (output_directories.size() > 1 && writer_backend == WriterBackend::Stream) {
+        return std::string("Several output directories need the block or io_uring writer");
+      }
+      return std::string();
+    }();
+    static const bool indexed_files = env.GetValue("indexed_files", 0) != 0;
     static const auto event_handler = [&](Event&& event) { m_graphs.event_handle(std::move(event)); };
 
     // Style constants
@@ -215,7 +238,7 @@ class App {
 
       ImGui::SameLine();
       if (save_to_file) {
-        ImGui::Text("Writing to: %s-*.raw", file_prefix.data());
+        ImGui::Text(indexed_files ? "Writing to: %s-*.iraw" : "Writing to: %s-*.raw", file_prefix.data());
       } else {
         ImGui::TextColored(red, "Warning: not saving data to disk");
       }
@@ -225,17 +248,27 @@ class App {
       ImGui::PushStyleColor(ImGuiCol_Button, green);
       ImGui::PushStyleColor(ImGuiCol_ButtonHovered, green);
 
-      if (ImGui::Button("Start", start_button_size)) {
+      if (ImGui::Button("Start", start_button_size) && config_error.empty()) {
+        Acquisition::Config config {};
+        config.capture = *capture_mode;
+        config.decoder_threads = decoder_threads;
+        config.build_events = build_events;
+        config.writer = *writer_backend;
+        config.output_directories = output_directories;
+        config.indexed_files = indexed_files;
+
         if (save_to_file) {
           m_acquisition = std::make_unique<Acquisition>(
               file_prefix,
               save_raw,
               event_handler,
-              fec_address);
+              fec_address,
+              config);
         } else {
           m_acquisition = std::make_unique<Acquisition>(
               event_handler,
-              fec_address);
+              fec_address,
+              config);
         }
       }
       ImGui::PopStyleColor(3);
@@ -251,7 +284,11 @@ class App {
       }
 
       // Inform errors
-      if ((acquisition_error & Acquisition::ReadError) != 0) {
+      if (!config_error.empty()) {
+        ImGui::TextColored(red, "%s", config_error.c_str());
+      } else if ((acquisition_error & Acquisition::ReadError) != 0 && capture_mode == CaptureMode::Socket) {
+        ImGui::TextColored(red, "Unable to open the UDP socket, check if the port is already in use");
+      } else if ((acquisition_error & Acquisition::ReadError) != 0) {
         ImGui::TextColored(red, "Unable to read raw socket, try running as root");
       } else if ((acquisition_error & Acquisition::WriteErrorFileExists) != 0) {
         ImGui::TextColored(red, "File exists");
@@ -259,6 +296,8 @@ class App {
         ImGui::TextColored(red, "Directory don't exists");
       } else if ((acquisition_error & Acquisition::WriteErrorOpenFile) != 0) {
         ImGui::TextColored(red, "Unable to create output file");
+      } else if ((acquisition_error & Acquisition::WriteError) != 0) {
+        ImGui::TextColored(red, "Unable to write to the output file");
       }
     }
   }
@@ -303,6 +342,22 @@ class App {
     gui_info_colored("Net Buffer usage", stats.read_buffer_use, 0, 100, "%");
     ImGui::SameLine();
     gui_info_colored("Sniffer load", stats.read_load, 0, 100, "%");
+    ImGui::SameLine();
+    gui_info_colored("Dropped packets", stats.dropped_packets, 0, 1, "");
+
+    gui_info_colored("Dropped payloads", stats.dropped_payloads, 0, 1, "");
+    ImGui::SameLine();
+    gui_info_colored("Dropped events", stats.dropped_events, 0, 1, "");
+    ImGui::SameLine();
+    gui_info_colored("Buffer allocations/s", stats.payload_allocation_rate, 0, 1000, "");
+    ImGui::SameLine();
+    gui_info("Event reuse", stats.event_pool_hit_rate, "%");
+
+    gui_info_colored("Evicted events", stats.evicted_events, 0, 1, "");
+    ImGui::SameLine();
+    gui_info("Event memory", stats.event_memory, "MB");
+    ImGui::SameLine();
+    gui_info_colored("Incomplete built events", stats.incomplete_built_events, 0, 1, "");
 
     gui_info_colored("Write speed", stats.write_speed, 0, 80, "MB/s");
     ImGui::SameLine();
@@ -11,10 +11,9 @@
 
 #include <sampasrs/mapping.hpp>
 #include <sampasrs/clusters.hpp>
+#include <sampasrs/waveform_reader.hpp>
 
 #include "TFile.h"
-#include "TTreeReader.h"
-#include "TTreeReaderArray.h"
 
 const int max_time_window = 10; //maximum time difference before the maximum to be checked at 20MSps, 1 = 50ns
 const int Min_Number_words = 5; //Minimum number of ADC samples to consider a cluster valid  
@@ -49,12 +48,7 @@ Map_pedestal(pedestal_file, map_of_pedestals); // change the mapping on mapping.
 auto input_path = std::filesystem::path(file_name);
 auto Clstrootfname = input_path.replace_extension("ZS_Clst.root").string();
 TFile file(file_name.data(), "READ");
-TTreeReader reader("waveform", &file);
-TTreeReaderValue<std::vector<std::vector<short>>> words(reader, "words"); // template type must match datatype
-TTreeReaderArray<short> sampa(reader, "sampa");
-TTreeReaderArray<short> channel(reader, "channel");
-TTreeReaderArray<double> x(reader, "x");
-TTreeReaderArray<double> y(reader, "y");
+sampasrs::WaveformReader reader(file); // nested or flat layout
 
 TFile* hfile = new TFile(Clstrootfname.c_str(),"RECREATE");
   
@@ -115,10 +109,14 @@ int num_bad_evt = 0;
 std::vector <Hits_evt> hitsx; 
 std::vector <Hits_evt> hitsy; 
 int event_id = 0;
-  while ( reader.Next() ) 
+  while ( reader.next() ) 
   {
 
-    auto& event_words = *words;
+    const auto& event_words = reader.words();
+    const auto& sampa = reader.sampa();
+    const auto& channel = reader.channel();
+    const auto& x = reader.x();
+    const auto& y = reader.y();
     for (size_t i = 0; i < event_words.size(); ++i) 
     {
       E_int=0;